@@ -1,7 +1,21 @@
 #include "app.h"
 #include "../graphics/graphics.h"
 #include "../images/images.h"
+#include "../atlas/atlas.h"
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#include "batch.h"
+#include "daemon.h"
+#include "stream.h"
+#include "shaders.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
 
 
 const char* imageVertexSource = R"(
@@ -14,10 +28,17 @@ void main() {
 }
 )";
 const char* imageFragmentSource = R"(
+#ifdef ARRAY
+uniform sampler2DArray uTexture;
+uniform int            uLayer;
+#define SAMPLE(uv) texture(uTexture, vec3(uv, float(uLayer)))
+#else
 uniform sampler2D uTexture;
+#define SAMPLE(uv) texture2D(uTexture, uv)
+#endif
 varying vec2      vTexture;
 void main() {
-    gl_FragColor = vec4(texture2D(uTexture, vTexture).rgb, 1.0);
+    gl_FragColor = vec4(SAMPLE(vTexture).rgb, 1.0);
 }
 )";
 
@@ -31,8 +52,47 @@ void main() {
 }
 )";
 
+// Texture arrays: one instance per layer, routed to its layer of the layered frame
+const char* blurArrayVertexSource = R"(
+in  vec3 aPosition;
+in  vec2 aTexture;
+out vec2 gTexture;
+flat out int gLayer;
+void main() {
+    gl_Position = vec4(aPosition.x, aPosition.y, aPosition.z, 1.0);
+    gTexture = aTexture;
+    gLayer = gl_InstanceID;
+}
+)";
+
+const char* layerGeometrySource = R"(
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+in  vec2 gTexture[];
+flat in int gLayer[];
+out vec2 vTexture;
+flat out int vLayer;
+void main() {
+    for (int i = 0; i < 3; i++) {
+        gl_Position = gl_in[i].gl_Position;
+        gl_Layer = gLayer[0];
+        vTexture = gTexture[i];
+        vLayer = gLayer[0];
+        EmitVertex();
+    }
+    EndPrimitive();
+}
+)";
+
 const char* blurFragmentSource = R"(
+#ifdef ARRAY
+uniform sampler2DArray uTexture;
+flat in int vLayer;
+#define SAMPLE(uv) texture(uTexture, vec3(uv, float(vLayer))).rgb
+#else
 uniform sampler2D uTexture;
+#define SAMPLE(uv) texture2D(uTexture, uv).rgb
+#endif
 uniform int       uWidth;
 uniform int       uHeight;
 uniform float     uRadius;
@@ -69,16 +129,16 @@ void main() {
 
 
     vec2 texOffset = 1.0 / uTextureSize; // gets size of single texel
-    vec3 result = texture2D(uTexture, vTexture).rgb * weight[0]; // current fragment's contribution
+    vec3 result = SAMPLE(vTexture) * weight[0]; // current fragment's contribution
     #ifdef HORIZONTAL
     for (int i = 1; i < KERNEL; i++) {
-        result += texture2D(uTexture, vTexture + vec2(texOffset.x * float(i), 0.0)).rgb * weight[i];
-        result += texture2D(uTexture, vTexture - vec2(texOffset.x * float(i), 0.0)).rgb * weight[i];
+        result += SAMPLE(vTexture + vec2(texOffset.x * float(i), 0.0)) * weight[i];
+        result += SAMPLE(vTexture - vec2(texOffset.x * float(i), 0.0)) * weight[i];
     }
     #else
     for (int i = 1; i < KERNEL; i++) {
-        result += texture2D(uTexture, vTexture + vec2(0.0, texOffset.y * float(i))).rgb * weight[i];
-        result += texture2D(uTexture, vTexture - vec2(0.0, texOffset.y * float(i))).rgb * weight[i];
+        result += SAMPLE(vTexture + vec2(0.0, texOffset.y * float(i))) * weight[i];
+        result += SAMPLE(vTexture - vec2(0.0, texOffset.y * float(i))) * weight[i];
     }
     #endif
 
@@ -86,6 +146,57 @@ void main() {
 }
 )";
 
+// Same kernel as blurFragmentSource, but every workgroup loads its TILE texels plus the
+// KERNEL - 1 halo on each side into shared memory once, instead of fetching 2 * KERNEL - 1
+// texels per output texel. A workgroup covers a row tile (HORIZONTAL) or a column tile
+const char* blurComputeSource = R"(
+layout(local_size_x = TILE, local_size_y = 1, local_size_z = 1) in;
+layout(FORMAT) uniform writeonly image2D uOutput;
+uniform sampler2D uTexture;
+uniform float     uRadius;
+
+#define HALO (KERNEL - 1)
+shared vec3  tile[TILE + 2 * HALO];
+shared float weight[KERNEL];
+
+void main() {
+    ivec2 size = textureSize(uTexture, 0);
+    int local = int(gl_LocalInvocationID.x);
+    #ifdef HORIZONTAL
+    ivec2 direction = ivec2(1, 0);
+    ivec2 origin = ivec2(int(gl_WorkGroupID.x) * TILE, int(gl_WorkGroupID.y));
+    #else
+    ivec2 direction = ivec2(0, 1);
+    ivec2 origin = ivec2(int(gl_WorkGroupID.y), int(gl_WorkGroupID.x) * TILE);
+    #endif
+
+    for (int i = local; i < TILE + 2 * HALO; i += TILE) {
+        ivec2 texel = clamp(origin + direction * (i - HALO), ivec2(0), size - 1);
+        tile[i] = texelFetch(uTexture, texel, 0).rgb;
+    }
+    if (local < KERNEL) {
+        weight[local] = exp(-(pow(float(local), 2.0) / (2.0 * pow(uRadius, 2.0))));
+    }
+    barrier();
+
+    float sum = weight[0];
+    for (int i = 1; i < KERNEL; i++) {
+        sum += 2.0 * weight[i];
+    }
+    vec3 result = tile[local + HALO] * weight[0];
+    for (int i = 1; i < KERNEL; i++) {
+        result += (tile[local + HALO + i] + tile[local + HALO - i]) * weight[i];
+    }
+
+    ivec2 texel = origin + direction * local;
+    if (texel.x < size.x && texel.y < size.y) {
+        imageStore(uOutput, texel, vec4(result / sum, 1.0));
+    }
+}
+)";
+const int blurComputeTile = 256;
+const int blurKernel = 11;  // Taps reach blurKernel - 1 texels on each side
+const int atlasMaxSize = 4096;
 
 
 WindowInfo windowInfo;
@@ -114,52 +225,384 @@ struct App {
     UniH  shaderVertBlur_uRadius;
     AttrH shaderVertBlur_aPosition;
     AttrH shaderVertBlur_aTexture;
-    
+
+    ShaH  shaderHoriCompute;
+    UniH  shaderHoriCompute_uTexture;
+    UniH  shaderHoriCompute_uOutput;
+    UniH  shaderHoriCompute_uRadius;
+
+    ShaH  shaderVertCompute;
+    UniH  shaderVertCompute_uTexture;
+    UniH  shaderVertCompute_uOutput;
+    UniH  shaderVertCompute_uRadius;
+
     RenderPass pass0;
     RenderPass pass1;
+
+    // Compute blur: horizontal into frameA, vertical into frameB, then a blit to the window
+    bool compute;
+    FraH frameB;
+    ComputePass computePass0;
+    ComputePass computePass1;
+    RenderPass blitPass;
+
+    // Several images of the same size: one texture array, blurred by one draw per pass
+    ShaH  shaderHoriBlurArray;
+    UniH  shaderHoriBlurArray_uTexture;
+    UniH  shaderHoriBlurArray_uWidth;
+    UniH  shaderHoriBlurArray_uHeight;
+    UniH  shaderHoriBlurArray_uRadius;
+    AttrH shaderHoriBlurArray_aPosition;
+    AttrH shaderHoriBlurArray_aTexture;
+
+    ShaH  shaderVertBlurArray;
+    UniH  shaderVertBlurArray_uTexture;
+    UniH  shaderVertBlurArray_uWidth;
+    UniH  shaderVertBlurArray_uHeight;
+    UniH  shaderVertBlurArray_uRadius;
+    AttrH shaderVertBlurArray_aPosition;
+    AttrH shaderVertBlurArray_aTexture;
+
+    ShaH  shaderImageArray;
+    UniH  shaderImageArray_uTexture;
+    UniH  shaderImageArray_uLayer;
+    AttrH shaderImageArray_aPosition;
+    AttrH shaderImageArray_aTexture;
+
+    bool array;
+    FraH arrayFrameA;
+    FraH arrayFrameB;
+    RenderPass arrayPass0;
+    RenderPass arrayPass1;
+    RenderPass arrayBlitPass;  // Shows one layer at a time
+
+    // Several images of different sizes: packed into one atlas, blurred by pass0 and pass1
+    // into frameB, shown by blitPass and cut back out once after the first frame
+    bool atlas;
+    bool atlasCutDone;
+    Atlas atlasLayout;
+    Image atlasImage;
+
+    // Headless batch: every input blurred into batchOutput, see batch.h
+    const char* batchOutput;
+    std::vector<std::string> batchInputs;
+    int batchDecoders;
+    int batchEncoders;
+    int batchPrefetchMB = 256;  // Encoded bytes read ahead of the decoders, 0 turns it off
+    int batchPrefetchFiles = 8;
+    int batchStripMP = 256;  // PPM and PGM inputs over this many megapixels are streamed in strips
+    int batchTileSize = 4096;  // Other inputs larger than a texture are blurred in tiles this size
+    int batchTileMB = 512;     // Or smaller, to keep the GPU and staging memory of a tile under this
+
+    // Headless resident service on a Unix domain socket, see daemon.h
+    const char* daemonSocket;
+    DaemonOptions daemonOptions;
+    Daemon daemon;
+    Batch batch;
+
+    // Headless raw video filter from stdin to stdout, see stream.h
+    int rawWidth;
+    int rawHeight;
+    int rawChannels;
+    FILE* rawOutput;
+    Stream stream;
     
     float radius;
     int textureUnit;
-    Image image;
+    std::vector<Image> images;
+    std::thread imageDecoder;  // Decodes images while the platform creates the context
+    bool imageDecoded;
     TexH texture;
+    bool gpuTimers;
+    const char* traceFile;
+    const char* metricsFile;
+    float metricsInterval;
+    FrameFormat intermediateFormat;
+    int frameCount;
     MeshH quadPos;
     MeshH quadTex;
+    MeshH quadTexFlipped;  // For passes drawing to the window
 
 } app;
 
+// Startup timeline, milliseconds since appEntry
+static std::chrono::steady_clock::time_point startupTime;
+static void startupEvent(const char* event) {
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - startupTime;
+    printf("Startup: %8.2f ms  %s\n", elapsed.count(), event);
+}
+
+static std::string formatDefine(FrameFormat format) {
+    return std::string("#define FORMAT ") + imageFormatQualifier(format) + "\n";
+}
+
+static void describeMetrics() {
+    metricsDescribe("blur_jobs_total", "Images or frames finished, by mode and status");
+    metricsDescribe("blur_pixels_total", "Pixels blurred, by mode");
+    metricsDescribe("blur_bytes_total", "Pixel bytes taken in and handed out, by mode and direction");
+    metricsDescribe("blur_job_seconds", "Time from receiving or decoding a job to its result");
+    metricsDescribe("blur_queue_wait_seconds", "Time a daemon job waited for its submission");
+    metricsDescribe("blur_gpu_submissions_total", "Daemon blurs sent to the GPU: single jobs, coalesced atlases and tiles");
+    metricsDescribe("blur_coalesced_jobs_total", "Daemon jobs blurred in an atlas, over atlas submissions is the mean batch size");
+    metricsDescribe("blur_stage_seconds", "CPU time of decode, upload, readback and encode");
+    metricsDescribe("blur_pass_gpu_seconds", "GPU time of every render pass, by pass name");
+    metricsDescribe("blur_queue_depth", "Jobs waiting in each queue");
+    metricsDescribe("blur_queued_bytes", "Pixel memory held by queued daemon jobs");
+    metricsDescribe("blur_gpu_memory_bytes", "Estimated GPU memory of frames, textures and pixel buffers");
+    metricsDescribe("blur_gpu_frames", "Frames allocated");
+    metricsDescribe("blur_frame_pool_total", "Frame pool lookups: hit, new or resized");
+    metricsDescribe("blur_shader_link_seconds", "Time blocked on a shader link on first use");
+}
+
+static void printGpuTimes() {
+    for (const GpuTime& time : app.graphics.gpuTimes()) {
+        printf("GPU %-16s min %.3f ms  median %.3f ms  p99 %.3f ms  (%d samples)\n",
+            time.name.c_str(), time.min, time.median, time.p99, time.samples);
+    }
+}
+
 extern "C" int appEntry(int argc, char** argv) {
-    if (argc <= 1) {
-        printf("Usage: blur <image_filename>");
-        return 0;
+    startupTime = std::chrono::steady_clock::now();
+    // Cheapest intermediate that keeps the horizontal pass result above 8 bits
+    app.intermediateFormat = FrameFormat::Rgb10A2;
+    std::vector<const char*> filenames;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gpu-timers") == 0) {
+            app.gpuTimers = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            app.traceFile = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            app.metricsFile = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            app.metricsInterval = static_cast<float>(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            app.batchOutput = argv[++i];
+        } else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc) {
+            app.daemonSocket = argv[++i];
+        } else if (strcmp(argv[i], "--raw") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &app.rawWidth, &app.rawHeight) != 2 || app.rawWidth <= 0 || app.rawHeight <= 0) {
+                printf("Error: --raw expects <width>x<height>, got %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--pix-fmt") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            if      (strcmp(format, "rgb24") == 0) app.rawChannels = 3;
+            else if (strcmp(format, "rgba") == 0)  app.rawChannels = 4;
+            else {
+                printf("Error: --pix-fmt expects rgb24 or rgba, got %s\n", format);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--coalesce-wait") == 0 && i + 1 < argc) {
+            app.daemonOptions.coalesceWait = static_cast<float>(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--coalesce-max") == 0 && i + 1 < argc) {
+            app.daemonOptions.coalesceMax = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            app.daemonOptions.tileSize = std::max(64, atoi(argv[++i]));
+            app.batchTileSize = app.daemonOptions.tileSize;
+        } else if (strcmp(argv[i], "--tile-memory") == 0 && i + 1 < argc) {
+            app.batchTileMB = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-jobs") == 0 && i + 1 < argc) {
+            app.daemonOptions.maxQueuedJobs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+            app.daemonOptions.maxQueuedBytes = static_cast<size_t>(std::max(1, atoi(argv[++i]))) << 20;
+        } else if (strcmp(argv[i], "--degrade-at") == 0 && i + 1 < argc) {
+            app.daemonOptions.degradeAt = static_cast<float>(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--decoders") == 0 && i + 1 < argc) {
+            app.batchDecoders = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--encoders") == 0 && i + 1 < argc) {
+            app.batchEncoders = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            app.batchPrefetchMB = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--prefetch-files") == 0 && i + 1 < argc) {
+            app.batchPrefetchFiles = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--strip-above") == 0 && i + 1 < argc) {
+            app.batchStripMP = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--list") == 0 && i + 1 < argc) {
+            if (!batchAddList(argv[++i], app.batchInputs)) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--compute") == 0) {
+            app.compute = true;
+        } else if (strcmp(argv[i], "--intermediate") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            if      (strcmp(format, "rgb8") == 0)       app.intermediateFormat = FrameFormat::Rgb8;
+            else if (strcmp(format, "rgb10a2") == 0)    app.intermediateFormat = FrameFormat::Rgb10A2;
+            else if (strcmp(format, "r11g11b10f") == 0) app.intermediateFormat = FrameFormat::R11G11B10F;
+            else if (strcmp(format, "rgba16f") == 0)    app.intermediateFormat = FrameFormat::Rgba16F;
+            else {
+                printf("Error: --intermediate expects rgb8, rgb10a2, r11g11b10f or rgba16f, got %s\n", format);
+                return 0;
+            }
+        } else {
+            filenames.push_back(argv[i]);
+        }
+    }
+    if (app.batchOutput != nullptr) {
+        for (const char* filename : filenames) {
+            if (!batchAddInputs(filename, app.batchInputs)) {
+                return 0;
+            }
+        }
+        filenames.clear();
+    }
+    if (app.rawWidth > 0) {
+        app.rawChannels = app.rawChannels > 0 ? app.rawChannels : 3;
+        app.rawOutput = streamTakeStdout();
+        windowInfo.headless = 1;
+        windowInfo.width = 64;
+        windowInfo.height = 64;
+        return 1;
     }
-    if (!app.image.read(argv[1])) {
+    if (app.daemonSocket != nullptr) {
+        windowInfo.headless = 1;
+        windowInfo.width = 64;
+        windowInfo.height = 64;
+        return 1;
+    }
+    if (filenames.empty() && (app.batchInputs.empty() || app.batchOutput == nullptr)) {
+        printf("Usage: blur [--gpu-timers] [--trace <trace.json>] [--intermediate <format>] [--compute] <image_filename>...\n");
+        printf("       every mode also takes [--metrics <file.prom>] [--metrics-interval <seconds>]\n");
+        printf("       blur --daemon <socket_path> [--coalesce-wait <ms>] [--coalesce-max <n>] [--tile-size <n>]\n");
+        printf("                    [--max-jobs <n>] [--max-memory <MB>] [--degrade-at <fraction>] [--intermediate <format>]\n");
+        printf("       blur --raw <width>x<height> [--pix-fmt rgb24|rgba] [--intermediate <format>] < frames > blurred_frames\n");
+        printf("       blur --batch <output_dir> [--list <list_file>] [--decoders <n>] [--encoders <n>] [--intermediate <format>]\n");
+        printf("                   [--prefetch <MB>] [--prefetch-files <n>] [--strip-above <MP>] [--tile-size <n>]\n");
+        printf("                   [--tile-memory <MB>] <file|directory|glob>...\n");
         return 0;
     }
-    windowInfo.width = app.image.width;
-    windowInfo.height = app.image.height;
+    if (app.batchOutput != nullptr) {
+        // Half the cores each by default, decode and encode are the CPU heavy stages
+        int cores = std::max(2, static_cast<int>(std::thread::hardware_concurrency()));
+        app.batchDecoders = app.batchDecoders > 0 ? app.batchDecoders : cores / 2;
+        app.batchEncoders = app.batchEncoders > 0 ? app.batchEncoders : cores / 2;
+        // Images are only read by the batch threads, the hidden window just carries the context
+        windowInfo.headless = 1;
+        windowInfo.width = 64;
+        windowInfo.height = 64;
+        return 1;
+    }
+    // The header is enough to size the window, decoding runs while the platform creates the context
+    app.images.resize(filenames.size());
+    std::vector<std::pair<int, int>> sizes;
+    for (int i = 0; i < filenames.size(); i++) {
+        if (!app.images[i].probe(filenames[i])) {
+            return 0;
+        }
+        sizes.push_back({ app.images[i].width, app.images[i].height });
+    }
+    bool sameSize = std::all_of(sizes.begin(), sizes.end(), [&sizes](const std::pair<int, int>& size) { return size == sizes[0]; });
+    app.array = app.images.size() > 1 && sameSize;
+    app.atlas = app.images.size() > 1 && !sameSize;
+    if (app.atlas) {
+        if (!atlasPack(sizes, blurKernel - 1, atlasMaxSize, app.atlasLayout)) {
+            return 0;
+        }
+        printf("Atlas: %d images in %d x %d\n", static_cast<int>(sizes.size()), app.atlasLayout.width, app.atlasLayout.height);
+        windowInfo.width = app.atlasLayout.width;
+        windowInfo.height = app.atlasLayout.height;
+    } else {
+        windowInfo.width = app.images[0].width;
+        windowInfo.height = app.images[0].height;
+    }
+    startupEvent("image probed");
+    app.imageDecoder = std::thread([filenames]() {
+        startupEvent("image decode begin");
+        app.imageDecoded = true;
+        for (int i = 0; i < filenames.size(); i++) {
+            app.imageDecoded = app.imageDecoded && app.images[i].read(filenames[i]);
+        }
+        if (app.imageDecoded && app.atlas) {
+            app.imageDecoded = atlasCompose(app.atlasLayout, app.images, app.atlasImage);
+        }
+        startupEvent("image decode end");
+    });
     return 1;
 }
 
 extern "C" int appInit() {
-    
-    app.frameA = app.graphics.addFrame(windowInfo.width, windowInfo.height);
+    startupEvent("context ready, init begin");
 
-    app.shaderImage = app.graphics.addShader(
-        "ShaderImage",
-        imageVertexSource,
-        imageFragmentSource,
-        {
-            "#version 120\n",
-        },
-        {
-            { app.shaderImage_uTexture, "uTexture" },
-        },
-        {
-            { app.shaderImage_aPosition, "aPosition" },
-            { app.shaderImage_aTexture,  "aTexture"  },
+    // Init first so the driver can spread the shader compiles below over its own threads
+    if (!app.graphics.init(windowInfo.scaleFactor, windowInfo.width, windowInfo.height)) {
+        return 0;
+    }
+
+    if (app.gpuTimers) {
+        app.graphics.enableGpuTimers(true);
+    }
+    if (app.metricsFile != nullptr) {
+        describeMetrics();
+        if (!metricsStart(app.metricsFile, app.metricsInterval)) {
+            return 0;
         }
-    );
+        // Feeds the per pass GPU time histograms
+        app.graphics.enableGpuTimers(true);
+    }
+    if (app.rawWidth > 0) {
+        return app.stream.init(app.graphics, app.rawOutput, app.rawWidth, app.rawHeight, app.rawChannels, app.intermediateFormat, 5.0f);
+    }
+    if (app.daemonSocket != nullptr) {
+        app.daemonOptions.intermediate = app.intermediateFormat;
+        return app.daemon.init(app.graphics, app.daemonSocket, app.daemonOptions);
+    }
+    if (app.batchOutput != nullptr) {
+        return app.batch.init(app.graphics, app.batchInputs, app.batchOutput, app.intermediateFormat, 5.0f, app.batchDecoders, app.batchEncoders,
+            static_cast<size_t>(app.batchPrefetchMB) << 20, app.batchPrefetchFiles, app.batchStripMP * 1000000LL, app.batchTileSize,
+            static_cast<size_t>(app.batchTileMB) << 20);
+    }
+    app.frameA = app.graphics.addFrame(windowInfo.width, windowInfo.height, app.intermediateFormat);
+    if (app.array && !app.graphics.supportsArrays()) {
+        printf("Texture arrays not supported\n");
+        return 0;
+    }
+    if ((app.array || app.atlas) && app.compute) {
+        printf("Compute blur takes a single image, using the fragment blur\n");
+        app.compute = false;
+    }
+    if (app.compute && !app.graphics.supportsCompute()) {
+        printf("Compute shaders not supported, using the fragment blur\n");
+        app.compute = false;
+    }
+    if (app.compute || app.atlas) {
+        app.frameB = app.graphics.addFrame(windowInfo.width, windowInfo.height, app.intermediateFormat);
+    }
+    if (app.compute) {
+        std::string tileDefine = "#define TILE " + std::to_string(blurComputeTile) + "\n";
+        app.shaderHoriCompute = app.graphics.addComputeShader(
+            "HorizontalComputeBlur",
+            blurComputeSource,
+            {
+                "#version 430\n",
+                "#define HORIZONTAL\n",
+                "#define KERNEL 11\n",
+                tileDefine.c_str(),
+                formatDefine(app.graphics.frameFormat(app.frameA)).c_str(),
+            },
+            {
+                { app.shaderHoriCompute_uTexture, "uTexture" },
+                { app.shaderHoriCompute_uOutput,  "uOutput" },
+                { app.shaderHoriCompute_uRadius,  "uRadius" },
+            }
+        );
+        app.shaderVertCompute = app.graphics.addComputeShader(
+            "VerticalComputeBlur",
+            blurComputeSource,
+            {
+                "#version 430\n",
+                "#define VERTICAL\n",
+                "#define KERNEL 11\n",
+                tileDefine.c_str(),
+                formatDefine(app.graphics.frameFormat(app.frameB)).c_str(),
+            },
+            {
+                { app.shaderVertCompute_uTexture, "uTexture" },
+                { app.shaderVertCompute_uOutput,  "uOutput" },
+                { app.shaderVertCompute_uRadius,  "uRadius" },
+            }
+        );
+    }
 
+    // Blur shaders go first, they gate the first frame. Compile status is only checked on first use
     app.shaderHoriBlur = app.graphics.addShader(
         "HorizontalBlur",
         blurVertexSource,
@@ -202,11 +645,91 @@ extern "C" int appInit() {
         }
     );
 
-
-    if (!app.graphics.init(windowInfo.scaleFactor, windowInfo.width, windowInfo.height)) {
-        return 0;
+    if (app.array) {
+        int layers = static_cast<int>(app.images.size());
+        app.arrayFrameA = app.graphics.addFrame(windowInfo.width, windowInfo.height, app.intermediateFormat, layers);
+        app.arrayFrameB = app.graphics.addFrame(windowInfo.width, windowInfo.height, app.intermediateFormat, layers);
+        app.shaderHoriBlurArray = app.graphics.addShader(
+            "HorizontalBlurArray",
+            blurArrayVertexSource,
+            blurFragmentSource,
+            {
+                "#version 150 compatibility\n",
+                "#define ARRAY\n",
+                "#define HORIZONTAL\n",
+                "#define KERNEL 11\n",
+            },
+            {
+                { app.shaderHoriBlurArray_uTexture, "uTexture" },
+                { app.shaderHoriBlurArray_uWidth,   "uWidth" },
+                { app.shaderHoriBlurArray_uHeight,  "uHeight" },
+                { app.shaderHoriBlurArray_uRadius,  "uRadius" },
+            },
+            {
+                { app.shaderHoriBlurArray_aPosition, "aPosition" },
+                { app.shaderHoriBlurArray_aTexture,  "aTexture"  },
+            },
+            layerGeometrySource
+        );
+        app.shaderVertBlurArray = app.graphics.addShader(
+            "VerticalBlurArray",
+            blurArrayVertexSource,
+            blurFragmentSource,
+            {
+                "#version 150 compatibility\n",
+                "#define ARRAY\n",
+                "#define VERTICAL\n",
+                "#define KERNEL 11\n",
+            },
+            {
+                { app.shaderVertBlurArray_uTexture, "uTexture" },
+                { app.shaderVertBlurArray_uWidth,   "uWidth" },
+                { app.shaderVertBlurArray_uHeight,  "uHeight" },
+                { app.shaderVertBlurArray_uRadius,  "uRadius" },
+            },
+            {
+                { app.shaderVertBlurArray_aPosition, "aPosition" },
+                { app.shaderVertBlurArray_aTexture,  "aTexture"  },
+            },
+            layerGeometrySource
+        );
+        app.shaderImageArray = app.graphics.addShader(
+            "ShaderImageArray",
+            imageVertexSource,
+            imageFragmentSource,
+            {
+                "#version 150 compatibility\n",
+                "#define ARRAY\n",
+            },
+            {
+                { app.shaderImageArray_uTexture, "uTexture" },
+                { app.shaderImageArray_uLayer,   "uLayer" },
+            },
+            {
+                { app.shaderImageArray_aPosition, "aPosition" },
+                { app.shaderImageArray_aTexture,  "aTexture"  },
+            }
+        );
     }
 
+    // Not used at startup, it finishes compiling in the background (see appRender)
+    app.shaderImage = app.graphics.addShader(
+        "ShaderImage",
+        imageVertexSource,
+        imageFragmentSource,
+        {
+            "#version 120\n",
+        },
+        {
+            { app.shaderImage_uTexture, "uTexture" },
+        },
+        {
+            { app.shaderImage_aPosition, "aPosition" },
+            { app.shaderImage_aTexture,  "aTexture"  },
+        }
+    );
+    startupEvent("shaders issued");
+
     float quadPosData[] = {
         -1, -1, 0,
          1,  1, 0,
@@ -226,12 +749,42 @@ extern "C" int appInit() {
     };
     app.quadPos = app.graphics.addMesh(3, 6, quadPosData, sizeof(quadPosData));
     app.quadTex = app.graphics.addMesh(2, 6, quadTexData, sizeof(quadTexData));
-    app.texture = app.graphics.addTexture(app.image);
+    // Images keep the file's row order, top row first, which puts their top at t = 0 and GL would
+    // show them upside down: the passes to the window sample them flipped instead
+    float quadTexFlippedData[] = {
+        0, 1,
+        1, 0,
+        0, 0,
+        0, 1,
+        1, 1,
+        1, 0,
+    };
+    app.quadTexFlipped = app.graphics.addMesh(2, 6, quadTexFlippedData, sizeof(quadTexFlippedData));
+
+    // Decode and context creation meet here
+    app.imageDecoder.join();
+    startupEvent("image decode joined");
+    if (!app.imageDecoded) {
+        return 0;
+    }
+    if (app.array) {
+        std::vector<const Image*> layers;
+        for (const Image& image : app.images) {
+            layers.push_back(&image);
+        }
+        app.texture = app.graphics.addTextureArray(layers);
+    } else if (app.atlas) {
+        app.texture = app.graphics.addTexture(app.atlasImage);
+    } else {
+        app.texture = app.graphics.addTexture(app.images[0]);
+    }
+    startupEvent("texture uploaded");
     app.textureUnit = 0; // Always the same texture unit
     app.radius = 5.0f;
 
     // Horizontal blur pass
     app.pass0 = {
+        "horizontal blur",
         app.frameA,
         app.shaderHoriBlur,
         app.texture,
@@ -253,6 +806,7 @@ extern "C" int appInit() {
 
     // Vertical blur pass
     app.pass1 = {
+        "vertical blur",
         invFraH,
         app.shaderVertBlur,
         invTexH,
@@ -268,12 +822,136 @@ extern "C" int appInit() {
         },
         {
             { app.shaderVertBlur_aPosition, app.quadPos },
-            { app.shaderVertBlur_aTexture,  app.quadTex }
+            { app.shaderVertBlur_aTexture,  app.atlas ? app.quadTex : app.quadTexFlipped }  // frameB is cut in the atlas's own row order
         }
     };
 
+    if (app.compute || app.atlas) {
+        app.blitPass = {
+            "blit",
+            invFraH,
+            app.shaderImage,
+            invTexH,
+            app.frameB,
+            app.textureUnit,
+            {
+                { app.shaderImage_uTexture, app.textureUnit },
+            },
+            { },
+            {
+                { app.shaderImage_aPosition, app.quadPos },
+                { app.shaderImage_aTexture,  app.quadTexFlipped }
+            }
+        };
+    }
+    if (app.atlas) {
+        app.pass1.frame = app.frameB;
+    }
+
+    if (app.compute) {
+        int rowTiles = (windowInfo.width + blurComputeTile - 1) / blurComputeTile;
+        int columnTiles = (windowInfo.height + blurComputeTile - 1) / blurComputeTile;
+        app.computePass0 = {
+            "horizontal blur",
+            app.frameA,
+            app.shaderHoriCompute,
+            app.texture,
+            invFraH,
+            app.textureUnit,
+            0,
+            rowTiles,
+            windowInfo.height,
+            {
+                { app.shaderHoriCompute_uTexture, app.textureUnit },
+                { app.shaderHoriCompute_uOutput,  0 },
+            },
+            {
+                { app.shaderHoriCompute_uRadius,  app.radius }
+            }
+        };
+        app.computePass1 = {
+            "vertical blur",
+            app.frameB,
+            app.shaderVertCompute,
+            invTexH,
+            app.frameA,
+            app.textureUnit,
+            0,
+            columnTiles,
+            windowInfo.width,
+            {
+                { app.shaderVertCompute_uTexture, app.textureUnit },
+                { app.shaderVertCompute_uOutput,  0 },
+            },
+            {
+                { app.shaderVertCompute_uRadius,  app.radius }
+            }
+        };
+    }
+
+    if (app.array) {
+        app.arrayPass0 = {
+            "horizontal blur",
+            app.arrayFrameA,
+            app.shaderHoriBlurArray,
+            app.texture,
+            invFraH,
+            app.textureUnit,
+            {
+                { app.shaderHoriBlurArray_uTexture, app.textureUnit },
+                { app.shaderHoriBlurArray_uWidth,   windowInfo.width       },
+                { app.shaderHoriBlurArray_uHeight,  windowInfo.height      },
+            },
+            {
+                { app.shaderHoriBlurArray_uRadius,  app.radius }
+            },
+            {
+                { app.shaderHoriBlurArray_aPosition, app.quadPos },
+                { app.shaderHoriBlurArray_aTexture,  app.quadTex }
+            }
+        };
+        app.arrayPass1 = {
+            "vertical blur",
+            app.arrayFrameB,
+            app.shaderVertBlurArray,
+            invTexH,
+            app.arrayFrameA,
+            app.textureUnit,
+            {
+                { app.shaderVertBlurArray_uTexture, app.textureUnit },
+                { app.shaderVertBlurArray_uWidth,   windowInfo.width       },
+                { app.shaderVertBlurArray_uHeight,  windowInfo.height      },
+            },
+            {
+                { app.shaderVertBlurArray_uRadius,  app.radius }
+            },
+            {
+                { app.shaderVertBlurArray_aPosition, app.quadPos },
+                { app.shaderVertBlurArray_aTexture,  app.quadTex }
+            }
+        };
+        app.arrayBlitPass = {
+            "blit",
+            invFraH,
+            app.shaderImageArray,
+            invTexH,
+            app.arrayFrameB,
+            app.textureUnit,
+            {
+                { app.shaderImageArray_uTexture, app.textureUnit },
+                { app.shaderImageArray_uLayer,   0 },
+            },
+            { },
+            {
+                { app.shaderImageArray_aPosition, app.quadPos },
+                { app.shaderImageArray_aTexture,  app.quadTexFlipped }
+            }
+        };
+    }
+
     // Uncomment to render the original image
 //    app.pass1 = {
+//        "original",
 //        invFraH,
 //        app.shaderImage,
 //        app.texture,
@@ -285,7 +963,7 @@ extern "C" int appInit() {
 //        { },
 //        {
 //            { app.shaderImage_aPosition, app.quadPos },
-//            { app.shaderImage_aTexture,  app.quadTex }
+//            { app.shaderImage_aTexture,  app.quadTexFlipped }
 //        }
 //    };
 
@@ -293,12 +971,81 @@ extern "C" int appInit() {
 }
 
 extern "C" int appRender(void) {
+    TRACE_SCOPE("appRender");
+    static bool firstFrame = true;
+    app.graphics.publishMetrics();
+    if (app.rawWidth > 0) {
+        if (app.stream.step()) {
+            return 1;
+        }
+        app.stream.report();
+        return 0;
+    }
+    if (app.daemonSocket != nullptr) {
+        return app.daemon.step();
+    }
+    if (app.batchOutput != nullptr) {
+        if (app.batch.step()) {
+            return 1;
+        }
+        app.batch.report();
+        return 0;
+    }
+    app.graphics.pollShaders();
     app.graphics.clear();
-    app.graphics.render(app.pass0);
-    app.graphics.render(app.pass1);
+    if (app.compute) {
+        app.graphics.render(app.computePass0);
+        app.graphics.render(app.computePass1);
+        app.graphics.render(app.blitPass);
+    } else if (app.array) {
+        // All layers are blurred every frame, the window shows a different one every second
+        app.graphics.render(app.arrayPass0);
+        app.graphics.render(app.arrayPass1);
+        app.arrayBlitPass.uniformsInt[1].second = (app.frameCount / 60) % static_cast<int>(app.images.size());
+        app.graphics.render(app.arrayBlitPass);
+    } else if (app.atlas) {
+        app.graphics.render(app.pass0);
+        app.graphics.render(app.pass1);
+        app.graphics.render(app.blitPass);
+    } else {
+        app.graphics.render(app.pass0);
+        app.graphics.render(app.pass1);
+    }
+    if (app.atlas && !app.atlasCutDone) {
+        // A full synchronous readback, tried once to check the round trip, not every frame
+        app.atlasCutDone = true;
+        Image blurred;
+        std::vector<Image> cuts;
+        if (app.graphics.readFrame(app.frameB, blurred) && atlasCut(app.atlasLayout, blurred, cuts)) {
+            printf("Atlas: cut %d blurred images\n", static_cast<int>(cuts.size()));
+        } else {
+            printf("Error: could not read back and cut the atlas\n");
+        }
+    }
+    if (firstFrame) {
+        startupEvent("first frame submitted");
+        firstFrame = false;
+    }
+    app.frameCount++;
+    if (app.gpuTimers && app.frameCount % 300 == 0) {
+        printGpuTimes();
+    }
     return 1;
 }
 
 extern "C" int appDeinit(void) {
+    if (app.gpuTimers) {
+        printGpuTimes();
+    }
+    if (app.imageDecoder.joinable()) {
+        app.imageDecoder.join();
+    }
+    if (app.daemonSocket != nullptr) {
+        app.daemon.close();
+    }
+    metricsStop();
+    if (app.traceFile != nullptr && !traceDump(app.traceFile)) {
+        printf("Trace not compiled in, build with BLUR_TRACE defined\n");
+    }
     return 1;
 }
@@ -7,6 +7,7 @@ typedef struct {
     int width;          // Read by the platform
     int height;         // Read by the platform
     float scaleFactor;  // Written to by the platform before appInit
+    int headless;       // Read by the platform: hidden window, appRender is called until it returns 0
 } WindowInfo;
 
 extern WindowInfo windowInfo;
@@ -0,0 +1,406 @@
+#include "batch.h"
+#include "strips.h"
+#include "../metrics/metrics.h"
+#include "../pool/pool.h"
+#include "../trace/trace.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <set>
+
+namespace fs = std::filesystem;
+
+
+static double millisecondsSince(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static bool isPnm(const unsigned char* magic) {
+    return magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6');
+}
+
+static bool isPnmFile(const char* filename) {
+    unsigned char magic[2] = {};
+    FILE* file = fopen(filename, "rb");
+    bool read = file != nullptr && fread(magic, 1, 2, file) == 2;
+    if (file != nullptr) {
+        fclose(file);
+    }
+    return read && isPnm(magic);
+}
+
+static bool isImageFile(const fs::path& path) {
+    static const char* extensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tga", ".psd", ".gif", ".hdr", ".pic", ".ppm", ".pgm", ".pnm" };
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    for (const char* known : extensions) {
+        if (extension == known) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// '*' matches any run of characters, '?' a single one
+static bool wildcardMatch(const char* pattern, const char* name) {
+    if (*pattern == '\0') {
+        return *name == '\0';
+    }
+    if (*pattern == '*') {
+        return wildcardMatch(pattern + 1, name) || (*name != '\0' && wildcardMatch(pattern, name + 1));
+    }
+    return *name != '\0' && (*pattern == '?' || *pattern == *name) && wildcardMatch(pattern + 1, name + 1);
+}
+
+bool batchAddInputs(const char* path, std::vector<std::string>& inputs) {
+    std::error_code error;
+    std::vector<std::string> found;
+    if (strchr(path, '*') != nullptr || strchr(path, '?') != nullptr) {
+        fs::path pattern(path);
+        fs::path directory = pattern.has_parent_path() ? pattern.parent_path() : fs::path(".");
+        std::string name = pattern.filename().string();
+        for (const fs::directory_entry& entry : fs::directory_iterator(directory, error)) {
+            if (entry.is_regular_file() && wildcardMatch(name.c_str(), entry.path().filename().string().c_str())) {
+                found.push_back(entry.path().string());
+            }
+        }
+    } else if (fs::is_directory(path, error)) {
+        for (const fs::directory_entry& entry : fs::directory_iterator(path, error)) {
+            if (entry.is_regular_file() && isImageFile(entry.path())) {
+                found.push_back(entry.path().string());
+            }
+        }
+    } else if (fs::is_regular_file(path, error)) {
+        found.push_back(path);
+    }
+    if (error || found.empty()) {
+        printf("Error: no input images in %s\n", path);
+        return false;
+    }
+    std::sort(found.begin(), found.end());
+    inputs.insert(inputs.end(), found.begin(), found.end());
+    return true;
+}
+
+bool batchAddList(const char* filename, std::vector<std::string>& inputs) {
+    std::ifstream list(filename);
+    if (!list) {
+        printf("Error: can't read the list %s\n", filename);
+        return false;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            inputs.push_back(line);
+        }
+    }
+    return true;
+}
+
+bool Batch::init(Graphics& graphics, const std::vector<std::string>& inputs, const char* outputDir, FrameFormat intermediate, float radius, int decoders, int encoders,
+    size_t prefetchBytes, int prefetchFiles, long long stripPixels, int tileSize, size_t tileBudget) {
+    this->graphics = &graphics;
+    this->inputs = inputs;
+    this->outputDir = outputDir;
+    std::error_code error;
+    fs::create_directories(this->outputDir, error);
+    if (!fs::is_directory(this->outputDir, error)) {
+        printf("Error: can't create the output directory %s\n", outputDir);
+        return false;
+    }
+    nameOutputs();
+
+    if (!blurrer.init(graphics, intermediate)) {
+        return false;
+    }
+    this->radius = radius;
+    maxSize = graphics.maxTextureSize();
+    this->stripPixels = stripPixels;
+    this->tileSize = tileSize;
+    this->tileBudget = tileBudget;
+    for (int i = 0; i < readbackCount; i++) {
+        readbacks[i] = graphics.addReadback();
+    }
+
+    // Enough decoded images to cover the readbacks in flight, enough blurred ones to keep every
+    // encoder busy. Anything more would only grow memory while a later stage is the bottleneck
+    decoded.setCapacity(readbackCount + 1);
+    blurred.setCapacity(2 * encoders);
+    decodeStage.name = "decode";
+    decodeStage.threads = decoders;
+    glStage.name = "gl";
+    glStage.threads = 1;
+    encodeStage.name = "encode";
+    encodeStage.threads = encoders;
+    printf("Batch: %d images into %s, %d decode and %d encode threads\n", static_cast<int>(inputs.size()), outputDir, decoders, encoders);
+    begin = std::chrono::steady_clock::now();
+    if (prefetchBytes > 0) {
+        prefetcher.init(inputs, prefetchBytes, prefetchFiles);
+        printf("Batch: prefetching up to %d files and %.0f MB ahead with %s\n", prefetchFiles, prefetchBytes / 1048576.0, prefetcher.backend());
+    }
+    activeDecoders = decoders;
+    for (int i = 0; i < decoders; i++) {
+        decodeThreads.emplace_back(&Batch::decodeLoop, this);
+    }
+    for (int i = 0; i < encoders; i++) {
+        encodeThreads.emplace_back(&Batch::encodeLoop, this);
+    }
+    return true;
+}
+
+static long long nanosecondsSince(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+}
+
+void Batch::decodeLoop() {
+    for (int i = nextInput++; i < inputs.size(); i = nextInput++) {
+        BatchJob job;
+        job.index = i;
+        job.begin = std::chrono::steady_clock::now();
+        bool read;
+        {
+            TRACE_SCOPE("Batch::decode");
+            std::vector<unsigned char> file;
+            bool prefetched = prefetcher.take(i, file);
+            Image header;
+            read = prefetched ? header.probe(file.data(), file.size()) : header.probe(inputs[i].c_str());
+            bool large = header.width > maxSize || header.height > maxSize;
+            if (read && (large || static_cast<long long>(header.width) * header.height > stripPixels) &&
+                (prefetched ? file.size() >= 2 && isPnm(file.data()) : isPnmFile(inputs[i].c_str()))) {
+                // Left for the GL thread to stream, it's never decoded whole
+                job.strips = true;
+                job.image.width = header.width;
+                job.image.height = header.height;
+                job.image.channels = header.channels;
+            } else if (read && static_cast<long long>(header.width) * header.height * header.channels > INT_MAX) {
+                printf("Batch: %s is %d x %d, too large to decode whole\n", inputs[i].c_str(), header.width, header.height);
+                read = false;
+            } else if (read) {
+                read = prefetched ? job.image.decode(file.data(), file.size(), inputs[i].c_str()) : job.image.read(inputs[i].c_str());
+            }
+        }
+        job.decodeTime = millisecondsSince(job.begin);
+        decodeStage.busy += nanosecondsSince(job.begin);
+        if (!read) {
+            printf("Batch: [%d/%d] %s failed\n", i + 1, static_cast<int>(inputs.size()), inputs[i].c_str());
+            failed++;
+            metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+            continue;
+        }
+        metricsCount("blur_bytes_total", "mode=\"batch\",direction=\"in\"", static_cast<double>(job.image.width) * job.image.height * job.image.channels);
+        if (!decoded.push(std::move(job))) {
+            break;
+        }
+    }
+    // The last decoder out tells the GL thread no more images are coming
+    if (--activeDecoders == 0) {
+        decoded.close();
+    }
+}
+
+void Batch::encodeLoop() {
+    BatchJob job;
+    while (blurred.pop(job)) {
+        auto encodeBegin = std::chrono::steady_clock::now();
+        const std::string& input = inputs[job.index];
+        bool ok;
+        {
+            TRACE_SCOPE("Batch::encode");
+            ok = job.image.write(outputPath(job.index).c_str());
+        }
+        job.image.reset();
+        job.encodeTime = millisecondsSince(encodeBegin);
+        encodeStage.busy += nanosecondsSince(encodeBegin);
+        if (!ok) {
+            printf("Batch: [%d/%d] %s failed\n", job.index + 1, static_cast<int>(inputs.size()), input.c_str());
+            failed++;
+            metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+            continue;
+        }
+        succeeded(job);
+    }
+}
+
+// <stem>.png, or <stem>-<n>.png when an earlier input already took the name (x.jpg and x.png,
+// or a/x.jpg and b/x.jpg) or when it is one of the inputs (the output directory holds them): it
+// would be overwritten while it may still be waiting to be read
+void Batch::nameOutputs() {
+    std::set<std::string> sources;
+    std::error_code error;
+    for (const std::string& input : inputs) {
+        sources.insert(fs::weakly_canonical(input, error).string());
+    }
+    std::set<std::string> taken;
+    outputs.clear();
+    for (const std::string& input : inputs) {
+        fs::path stem = fs::path(outputDir) / fs::path(input).stem();
+        std::string output = stem.string() + ".png";
+        for (int n = 1;; n++) {
+            std::string canonical = fs::weakly_canonical(output, error).string();
+            bool aliased = sources.count(canonical) > 0 || (fs::exists(output, error) && fs::equivalent(output, input, error));
+            if (!aliased && taken.insert(canonical).second) {
+                break;
+            }
+            output = stem.string() + "-" + std::to_string(n) + ".png";
+        }
+        if (fs::path(output).stem() != fs::path(input).stem()) {
+            printf("Batch: %s is written to %s, its name is taken\n", input.c_str(), output.c_str());
+        }
+        outputs.push_back(output);
+    }
+}
+
+void Batch::succeeded(const BatchJob& job) {
+    written++;
+    pixels += static_cast<long long>(job.image.width) * job.image.height;
+    metricsCount("blur_jobs_total", "mode=\"batch\",status=\"ok\"");
+    metricsCount("blur_pixels_total", "mode=\"batch\"", static_cast<double>(job.image.width) * job.image.height);
+    metricsCount("blur_bytes_total", "mode=\"batch\",direction=\"out\"", static_cast<double>(job.image.width) * job.image.height * 3);
+    metricsObserve("blur_job_seconds", "mode=\"batch\"", millisecondsSince(job.begin) / 1e3);
+    printf("Batch: [%d/%d] %s  %d x %d  decode %.2f ms  gl %.2f ms  encode %.2f ms  latency %.2f ms\n",
+        job.index + 1, static_cast<int>(inputs.size()), inputs[job.index].c_str(), job.image.width, job.image.height,
+        job.decodeTime, job.glTime, job.encodeTime, millisecondsSince(job.begin));
+}
+
+// Larger than a texture, blurred a tile at a time straight into the result the encoders take
+void Batch::blurTiledJob(BatchJob& job) {
+    auto glBegin = std::chrono::steady_clock::now();
+    Image result;
+    bool ok = blurrer.blurTiled(job.image, radius, tileSize, tileBudget, result);
+    job.image = std::move(result);
+    job.glTime = millisecondsSince(glBegin);
+    glStage.busy += nanosecondsSince(glBegin);
+    if (!ok) {
+        printf("Batch: [%d/%d] %s failed\n", job.index + 1, static_cast<int>(inputs.size()), inputs[job.index].c_str());
+        failed++;
+        metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+        return;
+    }
+    blurred.push(std::move(job));
+}
+
+// Reads, blurs and encodes on its own threads, the GL thread waits for it like for any other blur
+void Batch::blurStripJob(BatchJob& job) {
+    auto glBegin = std::chrono::steady_clock::now();
+    bool ok = blurStrips(blurrer, maxSize, inputs[job.index].c_str(), outputPath(job.index).c_str(), radius);
+    job.glTime = millisecondsSince(glBegin);
+    glStage.busy += nanosecondsSince(glBegin);
+    if (!ok) {
+        printf("Batch: [%d/%d] %s failed\n", job.index + 1, static_cast<int>(inputs.size()), inputs[job.index].c_str());
+        failed++;
+        metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+        return;
+    }
+    succeeded(job);
+}
+
+void Batch::finishReadback() {
+    auto finishBegin = std::chrono::steady_clock::now();
+    BatchJob& job = inFlight[inFlightFirst];
+    bool read = graphics->endReadFrame(readbacks[inFlightFirst], job.image);
+    job.glTime += millisecondsSince(finishBegin);
+    glStage.busy += nanosecondsSince(finishBegin);
+    BatchJob finished = std::move(job);
+    inFlightFirst = (inFlightFirst + 1) % readbackCount;
+    inFlightCount--;
+    if (!read) {
+        printf("Batch: [%d/%d] %s failed\n", finished.index + 1, static_cast<int>(inputs.size()), inputs[finished.index].c_str());
+        failed++;
+        metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+        return;
+    }
+    blurred.push(std::move(finished));
+}
+
+bool Batch::step() {
+    TRACE_SCOPE("Batch::step");
+    // With nothing decoded yet the readbacks in flight are the only work, hand them to the
+    // encoders now instead of after the next decode
+    while (inFlightCount > 0 && decoded.size() == 0) {
+        finishReadback();
+    }
+    BatchJob job;
+    if (!decoded.pop(job)) {
+        // Every input is decoded and blurred, drain the readbacks and wait for the encoders
+        while (inFlightCount > 0) {
+            finishReadback();
+        }
+        blurred.close();
+        for (std::thread& thread : decodeThreads) {
+            thread.join();
+        }
+        prefetcher.stop();
+        for (std::thread& thread : encodeThreads) {
+            thread.join();
+        }
+        decodeThreads.clear();
+        encodeThreads.clear();
+        seconds = millisecondsSince(begin) / 1000.0;
+        return false;
+    }
+    if (job.strips) {
+        blurStripJob(job);
+        return true;
+    }
+    if (job.image.width > maxSize || job.image.height > maxSize) {
+        blurTiledJob(job);
+        return true;
+    }
+    if (inFlightCount == readbackCount) {
+        finishReadback();
+    }
+
+    auto glBegin = std::chrono::steady_clock::now();
+    bool ok = blurrer.blur(job.image, radius);
+    // The upload copied the pixels, the blurred result gets its own buffer at endReadFrame
+    job.image.reset();
+    if (!ok) {
+        printf("Batch: [%d/%d] %s failed\n", job.index + 1, static_cast<int>(inputs.size()), inputs[job.index].c_str());
+        failed++;
+        metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+        return true;
+    }
+    int slot = (inFlightFirst + inFlightCount) % readbackCount;
+    ok = graphics->beginReadFrame(readbacks[slot], blurrer.result());
+    job.glTime = millisecondsSince(glBegin);
+    glStage.busy += nanosecondsSince(glBegin);
+    if (!ok) {
+        printf("Batch: [%d/%d] %s failed\n", job.index + 1, static_cast<int>(inputs.size()), inputs[job.index].c_str());
+        failed++;
+        metricsCount("blur_jobs_total", "mode=\"batch\",status=\"failed\"");
+        return true;
+    }
+    inFlight[slot] = std::move(job);
+    inFlightCount++;
+
+    // Hand over whatever already landed without waiting on the rest
+    while (inFlightCount > 0 && graphics->isReadDone(readbacks[inFlightFirst])) {
+        finishReadback();
+    }
+    metricsSet("blur_queue_depth", "queue=\"batch_decoded\"", static_cast<double>(decoded.size()));
+    metricsSet("blur_queue_depth", "queue=\"batch_readback\"", inFlightCount);
+    metricsSet("blur_queue_depth", "queue=\"batch_blurred\"", static_cast<double>(blurred.size()));
+    return true;
+}
+
+void Batch::report() {
+    double megapixels = pixels / 1e6;
+    printf("Batch: %d images blurred, %d failed, %.1f MP in %.2f s: %.1f images/s, %.1f MP/s\n",
+        written.load(), failed.load(), megapixels, seconds,
+        seconds > 0 ? written / seconds : 0.0, seconds > 0 ? megapixels / seconds : 0.0);
+    for (const BatchStage* stage : { &decodeStage, &glStage, &encodeStage }) {
+        double utilization = seconds > 0 ? stage->busy / 1e9 / (seconds * stage->threads) : 0.0;
+        printf("Batch: %-6s %2d threads %5.1f%% busy\n", stage->name, stage->threads, 100.0 * utilization);
+    }
+    PoolStats pool = poolStats();
+    printf("Batch: pixel buffers %lld reused, %lld allocated, %.1f MB pooled\n", pool.reused, pool.allocated, pool.held / 1e6);
+}
+
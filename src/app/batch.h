@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../graphics/graphics.h"
+#include "../images/images.h"
+#include "blurrer.h"
+#include "prefetch.h"
+#include "queue.h"
+
+// Headless batch mode: blurs every input into an output directory as PNG and reports per-image
+// and aggregate throughput. The stages run concurrently, with bounded queues in between:
+//   decode threads -> GL thread (upload, blur passes, async readback) -> encode threads
+// so in steady state the slowest stage is the only bottleneck. A prefetcher reads the encoded
+// files ahead of the decoders, within a byte budget
+
+
+// Adds a file, the images of a directory, or the files matching a glob over file names
+// ("photos/*.jpg", the directory part is taken literally)
+bool batchAddInputs(const char* path, std::vector<std::string>& inputs);
+// Adds every non-empty line of a list file
+bool batchAddList(const char* filename, std::vector<std::string>& inputs);
+
+struct BatchJob {
+    int index;
+    Image image;  // Decoded source, then the blurred result
+    std::chrono::steady_clock::time_point begin;
+    double decodeTime;  // Milliseconds
+    double glTime;      // Upload, passes and readback map
+    double encodeTime;
+    bool strips = false;  // Too large to decode whole, blurred from file to file by blurStrips
+};
+
+// Busy time of the threads of a stage, utilization is busy / (threads * wall time)
+struct BatchStage {
+    const char* name;
+    int threads;
+    std::atomic<long long> busy{ 0 };  // Nanoseconds
+};
+
+class Batch {
+public:
+    // Starts the decode and encode threads, the GL work happens in step()
+    // prefetchBytes 0 leaves the reads to the decoders. PPM and PGM inputs with more than
+    // stripPixels pixels, or larger than a texture, are streamed through blurStrips. Other
+    // inputs larger than a texture are decoded whole and blurred in tiles of tileSize, or smaller
+    // ones if those would take more than tileBudget bytes of GPU and staging memory
+    // Outputs are named after the inputs, made unique where two would collide or one is an input
+    bool init(Graphics& graphics, const std::vector<std::string>& inputs, const char* outputDir, FrameFormat intermediate, float radius, int decoders, int encoders,
+        size_t prefetchBytes, int prefetchFiles, long long stripPixels, int tileSize, size_t tileBudget);
+    bool step();    // GL thread: blurs the next decoded image, false once every image is written
+    void report();  // Aggregate throughput and stage utilization
+
+private:
+    static const int readbackCount = 3;  // Blurred images in flight between the passes and the map
+
+    Graphics* graphics = nullptr;
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;  // One per input, see nameOutputs
+    std::string outputDir;
+    std::atomic<int> nextInput{ 0 };
+    std::atomic<int> activeDecoders{ 0 };
+    std::atomic<int> written{ 0 };
+    std::atomic<int> failed{ 0 };
+    std::atomic<long long> pixels{ 0 };
+    std::chrono::steady_clock::time_point begin;
+    double seconds = 0;
+
+    BatchStage decodeStage;
+    BatchStage glStage;
+    BatchStage encodeStage;
+    std::vector<std::thread> decodeThreads;
+    std::vector<std::thread> encodeThreads;
+    Prefetcher prefetcher;
+    BoundedQueue<BatchJob> decoded;
+    BoundedQueue<BatchJob> blurred;
+
+    ReadH readbacks[readbackCount];
+    BatchJob inFlight[readbackCount];
+    int inFlightFirst = 0;
+    int inFlightCount = 0;
+
+    Blurrer blurrer;
+    float radius;
+    int maxSize = 0;  // Texture size limit
+    long long stripPixels = 0;
+    int tileSize = 0;
+    size_t tileBudget = 0;
+
+    void decodeLoop();
+    void encodeLoop();
+    void finishReadback();  // Oldest in flight, blocks until its copy is done
+    void blurStripJob(BatchJob& job);
+    void blurTiledJob(BatchJob& job);
+    void nameOutputs();
+    const std::string& outputPath(int index) const { return outputs[index]; }
+    void succeeded(const BatchJob& job);  // Counts and reports a written image
+};
@@ -0,0 +1,280 @@
+#include "blurrer.h"
+#include "shaders.h"
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+bool Blurrer::init(Graphics& graphics, FrameFormat intermediate) {
+    this->graphics = &graphics;
+    this->intermediate = intermediate;
+
+    float quadPosData[] = {
+        -1, -1, 0,
+         1,  1, 0,
+        -1,  1, 0,
+        -1, -1, 0,
+         1, -1, 0,
+         1,  1, 0,
+    };
+    float quadTexData[] = {
+        0, 0,
+        1, 1,
+        0, 1,
+        0, 0,
+        1, 0,
+        1, 1,
+    };
+    quadPos = graphics.addMesh(3, 6, quadPosData, sizeof(quadPosData));
+    quadTex = graphics.addMesh(2, 6, quadTexData, sizeof(quadTexData));
+
+    for (int reduced = 0; reduced < 2; reduced++) {
+        for (int vertical = 0; vertical < 2; vertical++) {
+            addProgram(programs[reduced][vertical], vertical != 0, reduced != 0);
+        }
+    }
+    return true;
+}
+
+void Blurrer::addProgram(BlurProgram& program, bool vertical, bool reduced) {
+    program.shader = graphics->addShader(
+        vertical ? (reduced ? "VerticalBlurReduced" : "VerticalBlur") : (reduced ? "HorizontalBlurReduced" : "HorizontalBlur"),
+        blurVertexSource,
+        blurFragmentSource,
+        {
+            "#version 120\n",
+            vertical ? "#define VERTICAL\n" : "#define HORIZONTAL\n",
+            reduced ? "#define KERNEL 5\n" : "#define KERNEL 11\n",
+        },
+        {
+            { program.uTexture, "uTexture" },
+            { program.uWidth,   "uWidth" },
+            { program.uHeight,  "uHeight" },
+            { program.uRadius,  "uRadius" },
+        },
+        {
+            { program.aPosition, "aPosition" },
+            { program.aTexture,  "aTexture"  },
+        }
+    );
+
+    // Frames, texture, image size and radius are filled in per blur
+    int textureUnit = 0;
+    program.pass = {
+        vertical ? "vertical blur" : "horizontal blur",
+        invFraH,
+        program.shader,
+        invTexH,
+        invFraH,
+        textureUnit,
+        {
+            { program.uTexture, textureUnit },
+            { program.uWidth,   0 },
+            { program.uHeight,  0 },
+        },
+        {
+            { program.uRadius,  5.0f }
+        },
+        {
+            { program.aPosition, quadPos },
+            { program.aTexture,  quadTex }
+        }
+    };
+}
+
+bool Blurrer::warmUp() {
+    unsigned char pixel[3] = { 0, 0, 0 };
+    Image image;
+    image.borrow(pixel, 1, 1, 3);
+    return blur(image, 1.0f) && blur(image, 1.0f, true);
+}
+
+// Least recently used pair of the pool, resized when none has the size yet
+int Blurrer::acquireFrames(int width, int height) {
+    int found = -1;
+    for (int i = 0; i < pool.size(); i++) {
+        if (pool[i].width == width && pool[i].height == height) {
+            found = i;
+            break;
+        }
+    }
+    if (found == -1 && pool.size() < poolSize) {
+        FramePair pair;
+        pair.width = width;
+        pair.height = height;
+        pair.frameA = graphics->addFrame(width, height, intermediate);
+        pair.frameB = graphics->addFrame(width, height, FrameFormat::Rgb8);
+        if (pair.frameA.idx == -1 || pair.frameB.idx == -1) {
+            return -1;
+        }
+        found = static_cast<int>(pool.size());
+        pool.push_back(pair);
+        metricsCount("blur_frame_pool_total", "result=\"new\"");
+    } else if (found == -1) {
+        found = 0;
+        for (int i = 1; i < pool.size(); i++) {
+            if (pool[i].lastUse < pool[found].lastUse) {
+                found = i;
+            }
+        }
+        FramePair& pair = pool[found];
+        if (!graphics->resizeFrame(pair.frameA, width, height) || !graphics->resizeFrame(pair.frameB, width, height)) {
+            // One frame may already have the new size, so the pair matches no size until it's resized again
+            pair.width = -1;
+            pair.height = -1;
+            pair.lastUse = 0;
+            return -1;
+        }
+        pair.width = width;
+        pair.height = height;
+        metricsCount("blur_frame_pool_total", "result=\"resized\"");
+    } else {
+        metricsCount("blur_frame_pool_total", "result=\"hit\"");
+    }
+    pool[found].lastUse = uses++;
+    return found;
+}
+
+bool Blurrer::blur(const Image& source, float radius, bool reduced) {
+    TRACE_SCOPE("Blurrer::blur");
+    current = acquireFrames(source.width, source.height);
+    if (current == -1) {
+        printf("Error: can't blur a %d x %d image\n", source.width, source.height);
+        return false;
+    }
+    if (texture.idx == -1) {
+        texture = graphics->addTexture(source);
+        if (texture.idx == -1) {
+            return false;
+        }
+    } else if (!graphics->updateTexture(texture, source)) {
+        return false;
+    }
+    const FramePair& frames = pool[current];
+    RenderPass& pass0 = programs[reduced][0].pass;
+    RenderPass& pass1 = programs[reduced][1].pass;
+    pass0.frame = frames.frameA;
+    pass0.texture = texture;
+    pass0.uniformsInt[1].second = source.width;
+    pass0.uniformsInt[2].second = source.height;
+    pass0.uniformsFloat[0].second = radius;
+    pass1.frame = frames.frameB;
+    pass1.frameIn = frames.frameA;
+    pass1.uniformsInt[1].second = source.width;
+    pass1.uniformsInt[2].second = source.height;
+    pass1.uniformsFloat[0].second = radius;
+    graphics->render(pass0);
+    graphics->render(pass1);
+    return true;
+}
+
+FraH Blurrer::result() {
+    return current == -1 ? invFraH : pool[current].frameB;
+}
+
+Blurrer::Tile Blurrer::tileAt(const Image& source, int x, int y, int width, int height) {
+    // The halo is clipped at the image edges, where clamping the tile's texture repeats the
+    // same edge pixels clamping the whole image would
+    Tile tile;
+    tile.x = x;
+    tile.y = y;
+    tile.width = width;
+    tile.height = height;
+    tile.x0 = std::max(0, x - reach);
+    tile.y0 = std::max(0, y - reach);
+    tile.x1 = std::min(source.width, x + width + reach);
+    tile.y1 = std::min(source.height, y + height + reach);
+    return tile;
+}
+
+bool Blurrer::copyTile(const Image& source, const Tile& tile) {
+    int width = tile.x1 - tile.x0;
+    int height = tile.y1 - tile.y0;
+    if (!tileSource.allocate(width, height, source.channels)) {
+        return false;
+    }
+    for (int row = tile.y0; row < tile.y1; row++) {
+        memcpy(tileSource.row(row - tile.y0), source.row(row) + static_cast<size_t>(tile.x0) * source.channels, tileSource.rowSize());
+    }
+    return true;
+}
+
+void Blurrer::pasteTile(const Image& blurred, const Tile& tile, Image& out) {
+    for (int row = 0; row < tile.height; row++) {
+        memcpy(out.row(tile.y + row) + static_cast<size_t>(tile.x) * 3,
+            blurred.row(tile.y - tile.y0 + row) + static_cast<size_t>(tile.x - tile.x0) * 3, static_cast<size_t>(tile.width) * 3);
+    }
+}
+
+bool Blurrer::blurTile(const Image& source, int x, int y, int width, int height, float radius, Image& out, bool reduced) {
+    TRACE_SCOPE("Blurrer::blurTile");
+    Tile tile = tileAt(source, x, y, width, height);
+    if (!copyTile(source, tile) || !blur(tileSource, radius, reduced) || !graphics->readFrame(result(), tileBlurred)) {
+        return false;
+    }
+    pasteTile(tileBlurred, tile, out);
+    return true;
+}
+
+// Largest tile side, halo included, whose memory fits the budget at worst: edge tiles have other
+// sizes, so every frame pair of the pool can be tile sized at once, next to the source texture
+// with its two upload buffers, the two readbacks and the tile's source and blurred copies
+int Blurrer::tileSideWithin(size_t memoryBudget, int channels) {
+    size_t frameBytes = (intermediate == FrameFormat::Rgba16F ? 8 : 4) + 4;  // Drivers pad RGB8 to 4 bytes
+    size_t texelBytes = poolSize * frameBytes + 3 * channels + 2 * 3 + channels + 3;
+    return static_cast<int>(sqrt(static_cast<double>(memoryBudget / texelBytes)));
+}
+
+bool Blurrer::blurTiled(const Image& source, float radius, int tileSize, size_t memoryBudget, Image& out, bool reduced) {
+    TRACE_SCOPE("Blurrer::blurTiled");
+    tileSize = std::min(tileSize, graphics->maxTextureSize() - 2 * reach);
+    tileSize = std::max(64, std::min(tileSize, tileSideWithin(memoryBudget, source.channels) - 2 * reach));
+    if (!out.allocate(source.width, source.height, 3)) {
+        return false;
+    }
+    for (ReadH& readback : tileReadbacks) {
+        if (readback.idx == -1) {
+            readback = graphics->addReadback();
+        }
+    }
+
+    // Two readbacks alternate: tile n is copied and uploaded while tile n - 1 is still on the
+    // GPU, then n - 1 is mapped and pasted
+    Tile inFlight[2];
+    int begun = 0;
+    int ended = 0;
+    bool ok = true;
+    for (int y = 0; y < source.height && ok; y += tileSize) {
+        for (int x = 0; x < source.width && ok; x += tileSize) {
+            Tile tile = tileAt(source, x, y, std::min(tileSize, source.width - x), std::min(tileSize, source.height - y));
+            ok = copyTile(source, tile) && blur(tileSource, radius, reduced) &&
+                graphics->beginReadFrame(tileReadbacks[begun % 2], result());
+            if (!ok) {
+                break;
+            }
+            inFlight[begun % 2] = tile;
+            begun++;
+            if (begun - ended == 2) {
+                ok = graphics->endReadFrame(tileReadbacks[ended % 2], tileBlurred);
+                if (ok) {
+                    pasteTile(tileBlurred, inFlight[ended % 2], out);
+                }
+                ended++;
+            }
+        }
+    }
+    // Map what's left even after a failure, so the readbacks can be reused
+    for (; ended < begun; ended++) {
+        bool read = graphics->endReadFrame(tileReadbacks[ended % 2], tileBlurred);
+        if (read && ok) {
+            pasteTile(tileBlurred, inFlight[ended % 2], out);
+        }
+        ok = ok && read;
+    }
+    return ok;
+}
+
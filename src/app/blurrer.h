@@ -0,0 +1,81 @@
+#pragma once
+#include <vector>
+#include "../graphics/graphics.h"
+#include "../images/images.h"
+
+// Offscreen two pass blur of images of any size, shared by the batch and daemon modes
+// One texture is reused for every source. Frames come from a small pool keyed by size, so
+// alternating between a few sizes doesn't reallocate them on every image
+// A reduced variant reads 5 texels a side instead of 11, a cheaper and coarser blur for
+// shedding load
+
+
+class Blurrer {
+public:
+    static const int reach = 10;  // Texels the passes read on each side of a pixel, KERNEL - 1
+
+    bool init(Graphics& graphics, FrameFormat intermediate);
+    bool warmUp();  // Links the shaders and allocates the first frames now instead of on the first blur
+    // Uploads source and renders both passes, the result is in result() until the next blur
+    bool blur(const Image& source, float radius, bool reduced = false);
+    FraH result();
+    // Blurs the width x height region at x, y of source into the same region of out (3 channels,
+    // the size of source), reading the reach texels around the region too. Matches blurring the
+    // whole image up to texture coordinate rounding (1 LSB), so a large one can be done a tile at a time
+    bool blurTile(const Image& source, int x, int y, int width, int height, float radius, Image& out, bool reduced = false);
+    // Blurs a source of any size, even over the texture limit, into out (3 channels, allocated
+    // here) in tiles of at most tileSize pixels a side plus the reach around them, smaller if the
+    // GPU and staging memory of tiles that size would go over memoryBudget bytes. The copy and
+    // upload of a tile overlap the passes and the readback of the one before
+    bool blurTiled(const Image& source, float radius, int tileSize, size_t memoryBudget, Image& out, bool reduced = false);
+
+private:
+    static const int poolSize = 4;
+
+    struct FramePair {
+        int width;
+        int height;
+        FraH frameA;  // Horizontal pass, intermediate format
+        FraH frameB;  // Vertical pass, read back as 8 bits so Rgb8 is enough
+        long long lastUse;
+    };
+
+    Graphics* graphics = nullptr;
+    FrameFormat intermediate;
+    std::vector<FramePair> pool;
+    long long uses = 0;
+    int current = -1;
+    TexH  texture = { -1 };
+    MeshH quadPos;
+    MeshH quadTex;
+
+    struct BlurProgram {
+        ShaH  shader;
+        UniH  uTexture;
+        UniH  uWidth;
+        UniH  uHeight;
+        UniH  uRadius;
+        AttrH aPosition;
+        AttrH aTexture;
+        RenderPass pass;
+    };
+
+    BlurProgram programs[2][2];  // [reduced][vertical]: texture into frameA, then frameA into frameB
+
+    Image tileSource;   // Region plus halo, reused between tiles
+    Image tileBlurred;
+    ReadH tileReadbacks[2] = { { -1 }, { -1 } };
+
+    // A tile is the region at x, y plus the halo it reads, clipped to the image: x0, y0 to x1, y1
+    struct Tile {
+        int x, y, width, height;
+        int x0, y0, x1, y1;
+    };
+    Tile tileAt(const Image& source, int x, int y, int width, int height);
+    bool copyTile(const Image& source, const Tile& tile);
+    void pasteTile(const Image& blurred, const Tile& tile, Image& out);
+
+    int acquireFrames(int width, int height);
+    int tileSideWithin(size_t memoryBudget, int channels);
+    void addProgram(BlurProgram& program, bool vertical, bool reduced);
+};
@@ -0,0 +1,930 @@
+#include "daemon.h"
+#include "../atlas/atlas.h"
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+const int daemonAtlasSize = 4096;  // Coalesced jobs share atlases up to this size
+
+static volatile sig_atomic_t daemonSignaled = 0;
+
+static void daemonSignal(int) {
+    daemonSignaled = 1;
+}
+
+// Receives what has arrived of the size bytes at data, after the received ones, without blocking
+// Also collects the descriptors sent along (SCM_RIGHTS) when fds is given: they arrive with the
+// first byte of the message they were attached to. False when the client hung up or failed
+static bool receiveSome(int socket, void* data, size_t size, size_t& received, std::vector<int>* fds) {
+    char control[CMSG_SPACE(4 * sizeof(int))];
+    iovec iov = { static_cast<char*>(data) + received, size - received };
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (fds != nullptr) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+    }
+    ssize_t got;
+    do {
+        got = recvmsg(socket, &message, MSG_DONTWAIT);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;  // Nothing more yet
+    }
+    if (got == 0) {
+        return false;
+    }
+    if (fds != nullptr) {
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+                int count = static_cast<int>((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                const int* descriptors = reinterpret_cast<const int*>(CMSG_DATA(header));
+                fds->insert(fds->end(), descriptors, descriptors + count);
+            }
+        }
+        if (message.msg_flags & MSG_CTRUNC) {
+            printf("Daemon: descriptors truncated\n");
+        }
+    }
+    received += got;
+    return true;
+}
+
+// Sends what the socket takes of the size bytes at data, after the sent ones, without blocking
+// False when the client hung up or failed
+static bool sendSome(int socket, const void* data, size_t size, size_t& sent) {
+    ssize_t count;
+    do {
+        count = send(socket, static_cast<const char*>(data) + sent, size - sent, MSG_DONTWAIT);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;  // Full for now
+    }
+    sent += count;
+    return true;
+}
+
+static const char* statusName(int32_t status) {
+    switch (status) {
+    case DaemonOk:          return "ok";
+    case DaemonBadRequest:  return "bad_request";
+    case DaemonReadFailed:  return "read_failed";
+    case DaemonBlurFailed:  return "blur_failed";
+    case DaemonWriteFailed: return "write_failed";
+    case DaemonExpired:     return "expired";
+    case DaemonBusy:        return "busy";
+    case DaemonDegraded:    return "degraded";
+    default:                return "unknown";
+    }
+}
+
+static float millisecondsSince(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+bool Daemon::init(Graphics& graphics, const char* socketPath, const DaemonOptions& options) {
+    this->graphics = &graphics;
+    this->socketPath = socketPath;
+    this->options = options;
+    // Compile, link and allocate now rather than on the first job
+    if (!blurrer.init(graphics, options.intermediate) || !blurrer.warmUp()) {
+        return false;
+    }
+    // A tile and the reach around it must fit in a texture
+    this->options.tileSize = std::min(options.tileSize, graphics.maxTextureSize() - 2 * Blurrer::reach);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        printf("Error: socket path too long %s\n", socketPath);
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        printf("Error: socket failed (%s)\n", strerror(errno));
+        return false;
+    }
+    unlink(socketPath);  // Left over by a daemon that didn't shut down cleanly
+    if (bind(listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenSocket, 16) != 0) {
+        printf("Error: can't listen on %s (%s)\n", socketPath, strerror(errno));
+        ::close(listenSocket);
+        listenSocket = -1;
+        return false;
+    }
+    signal(SIGINT, daemonSignal);
+    signal(SIGTERM, daemonSignal);
+    signal(SIGPIPE, SIG_IGN);  // A client hanging up mid response is an error on that client only
+    if (pipe(wakePipe) != 0 || fcntl(wakePipe[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(wakePipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        printf("Error: pipe failed (%s)\n", strerror(errno));
+        return false;
+    }
+    // Never full: every job the file threads get was admitted, and admission counts them
+    fileJobs.setCapacity(options.maxQueuedJobs + 1);
+    for (int i = 0; i < std::max(1, options.fileThreads); i++) {
+        fileThreads.emplace_back(&Daemon::fileLoop, this);
+    }
+    printf("Daemon: listening on %s, coalescing up to %d jobs within %.1f ms\n", socketPath, options.coalesceMax, options.coalesceWait);
+    return true;
+}
+
+bool Daemon::step() {
+    if (stopping || daemonSignaled) {
+        // Nothing already received goes unanswered
+        while (!pending.empty() || tiling || filesBusy > 0) {
+            if (pending.empty() && !tiling) {
+                pollfd wake = { wakePipe[0], POLLIN, 0 };
+                poll(&wake, 1, 100);
+            }
+            collectFiles();
+            schedule(true);
+        }
+        // And every answer goes out, unless its client stops reading
+        while (std::any_of(connections.begin(), connections.end(), [](const Connection& client) { return client.state == ConnectionAnswering; })) {
+            std::vector<pollfd> fds;
+            for (const Connection& client : connections) {
+                if (client.state == ConnectionAnswering) {
+                    fds.push_back({ client.socket, POLLOUT, 0 });
+                }
+            }
+            poll(fds.data(), fds.size(), 100);
+            for (const pollfd& fd : fds) {
+                if (fd.revents != 0 && !sendAnswer(*connection(fd.fd))) {
+                    drop(fd.fd);
+                }
+            }
+            dropStalled();
+        }
+        close();
+        return false;
+    }
+    // Short timeout so signals and shutdown are noticed even when idle, none while a tiled job
+    // has tiles left, shorter when a queued job's wait budget runs out sooner
+    int timeout = tiling ? 0 : 100;
+    for (const PendingJob& job : pending) {
+        float left = options.coalesceWait - millisecondsSince(job.queued);
+        timeout = std::max(0, std::min(timeout, static_cast<int>(ceilf(left))));
+    }
+    std::vector<pollfd> fds;
+    fds.push_back({ listenSocket, POLLIN, 0 });
+    fds.push_back({ wakePipe[0], POLLIN, 0 });
+    for (const Connection& client : connections) {
+        if (client.state == ConnectionAnswering) {
+            fds.push_back({ client.socket, POLLOUT, 0 });
+        } else if (client.state != ConnectionWaiting) {
+            fds.push_back({ client.socket, POLLIN, 0 });
+        }
+    }
+    if (poll(fds.data(), fds.size(), timeout) > 0) {
+        for (int i = 2; i < fds.size(); i++) {
+            Connection* client = connection(fds[i].fd);
+            bool answering = client->state == ConnectionAnswering;
+            if (fds[i].revents != 0 && !(answering ? sendAnswer(*client) : receive(*client))) {
+                drop(fds[i].fd);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept(listenSocket, nullptr, nullptr);
+            if (client >= 0) {
+                Connection accepted;
+                accepted.socket = client;
+                connections.push_back(std::move(accepted));
+            }
+        }
+    }
+    dropStalled();
+    collectFiles();
+    schedule(false);
+    metricsSet("blur_queue_depth", "queue=\"daemon\"", static_cast<double>(pending.size() + (tiling ? 1 : 0) + filesBusy));
+    metricsSet("blur_queued_bytes", "queue=\"daemon\"", static_cast<double>(counters.queuedBytes));
+    return true;
+}
+
+void Daemon::close() {
+    for (PendingJob& job : pending) {
+        release(job);
+    }
+    pending.clear();
+    if (tiling) {
+        release(tiled);
+        tiling = false;
+    }
+    fileJobs.close();
+    for (std::thread& thread : fileThreads) {
+        thread.join();
+    }
+    fileThreads.clear();
+    for (PendingJob& job : filesDone) {
+        release(job);
+    }
+    filesDone.clear();
+    for (Connection& connection : connections) {
+        if (connection.state != ConnectionWaiting) {
+            release(connection.job);
+        }
+        ::close(connection.socket);
+    }
+    connections.clear();
+    for (int& fd : wakePipe) {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    if (listenSocket >= 0) {
+        ::close(listenSocket);
+        unlink(socketPath.c_str());
+        listenSocket = -1;
+        printf("Daemon: stopped after %lld jobs (%lld interactive, %lld expired) in %lld GPU submissions, %lld coalesced, %lld tiles, %lld preemptions\n",
+            counters.jobs, counters.interactiveJobs, counters.expired, counters.submissions, counters.coalescedJobs, counters.tiles, counters.preemptions);
+        printf("Daemon: queued %.2f ms on average and %.2f ms at most, %.1f MB at most, %lld rejected, %lld degraded\n",
+            counters.jobs > 0 ? counters.waitTotal / counters.jobs : 0.0, counters.waitMax, counters.queuedBytesMax / 1e6,
+            counters.rejected, counters.degraded);
+    }
+}
+
+// Maps size bytes of a shared memory descriptor, nullptr if it's smaller than that or could shrink
+// A client truncating the object under the mapping would make the next upload or readback raise
+// SIGBUS and take the daemon down, so it must be sealed against shrinking first
+static unsigned char* mapShared(int fd, size_t size, bool writable) {
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+        printf("Daemon: rejecting shared memory without F_SEAL_SHRINK\n");
+        return nullptr;
+    }
+#else
+    printf("Daemon: shared memory jobs need sealed memfds, not available on this platform\n");
+    return nullptr;
+#endif
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 0 || static_cast<size_t>(info.st_size) < size) {
+        return nullptr;
+    }
+    void* mapped = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    return mapped == MAP_FAILED ? nullptr : static_cast<unsigned char*>(mapped);
+}
+
+Daemon::Connection* Daemon::connection(int client) {
+    for (Connection& candidate : connections) {
+        if (candidate.socket == client) {
+            return &candidate;
+        }
+    }
+    return nullptr;
+}
+
+// Closes the connection, giving up the request it was in the middle of
+void Daemon::drop(int client) {
+    auto found = std::find_if(connections.begin(), connections.end(), [client](const Connection& candidate) { return candidate.socket == client; });
+    if (found == connections.end()) {
+        return;
+    }
+    if (found->state != ConnectionWaiting) {
+        release(found->job);
+    }
+    ::close(client);
+    connections.erase(found);
+}
+
+// A client stuck mid request or mid answer only holds its own memory, until it's dropped
+void Daemon::dropStalled() {
+    for (int i = 0; i < connections.size();) {
+        const Connection& client = connections[i];
+        bool started = client.state != ConnectionWaiting && (client.state != ConnectionHeader || client.received > 0);
+        if (started && millisecondsSince(client.lastActive) > options.stallTimeout) {
+            printf("Daemon: dropping a client stalled for %d ms mid %s\n", options.stallTimeout, client.state == ConnectionAnswering ? "answer" : "request");
+            drop(client.socket);
+        } else {
+            i++;
+        }
+    }
+}
+
+bool Daemon::receive(Connection& connection) {
+    TRACE_SCOPE("Daemon::receive");
+    PendingJob& job = connection.job;
+    connection.lastActive = std::chrono::steady_clock::now();
+    if (connection.state == ConnectionHeader) {
+        if (!receiveSome(connection.socket, &job.request, sizeof(job.request), connection.received, &job.fds)) {
+            return false;  // Hung up, between jobs or not
+        }
+        if (connection.received < sizeof(job.request)) {
+            return true;
+        }
+        if (job.request.magic != daemonMagic) {
+            printf("Daemon: dropping a client, bad magic %08x\n", job.request.magic);
+            return false;
+        }
+        job.client = connection.socket;
+        job.arrival = std::chrono::steady_clock::now();
+        job.waited = 0.0f;
+        job.batch = 0;
+        job.tiles = 0;
+        job.bytes = 0;
+        job.retryAfter = 0.0f;
+        job.reduced = false;
+        connection.received = 0;
+        job.status = beginJob(connection);
+        if (job.status != DaemonOk || connection.state == ConnectionHeader) {
+            enqueue(connection);  // Nothing follows the header, or nothing more will be read
+        }
+        return true;
+    }
+
+    if (connection.state == ConnectionPaths) {
+        if (!receiveSome(connection.socket, &connection.paths[0], connection.paths.size(), connection.received, nullptr)) {
+            return false;
+        }
+        if (connection.received == connection.paths.size()) {
+            job.status = pathsReceived(connection);
+            enqueue(connection);
+        }
+    } else if (connection.state == ConnectionPixels) {
+        if (!receiveSome(connection.socket, job.source.pixels, job.source.size(), connection.received, nullptr)) {
+            return false;
+        }
+        if (connection.received == job.source.size()) {
+            enqueue(connection);
+        }
+    } else if (connection.state == ConnectionSkipping) {
+        // Skips the payload of a job answered DaemonBusy, so the connection stays usable for the retry
+        char buffer[64 * 1024];
+        size_t got = 0;
+        if (!receiveSome(connection.socket, buffer, std::min(connection.skipping, sizeof(buffer)), got, nullptr)) {
+            return false;
+        }
+        connection.skipping -= got;
+        if (connection.skipping == 0) {
+            enqueue(connection);
+        }
+    }
+    return true;
+}
+
+// Checks a request whose header just arrived and sets what to receive next. Shared memory jobs
+// map the client's pages instead: the texture is uploaded straight from them and the result
+// read back straight into them
+DaemonStatus Daemon::beginJob(Connection& connection) {
+    PendingJob& job = connection.job;
+    const DaemonRequest& request = job.request;
+    if (request.job == DaemonJobShutdown) {
+        return DaemonOk;
+    }
+    if (!(request.radius > 0.0f && request.radius <= 100.0f) || request.priority > DaemonPriorityInteractive || !(request.deadline >= 0.0f)) {
+        return DaemonBadRequest;
+    }
+    if (request.job == DaemonJobPath) {
+        if (request.inputSize == 0 || request.inputSize > 4096 || request.outputSize == 0 || request.outputSize > 4096) {
+            return DaemonBadRequest;
+        }
+        connection.paths.assign(request.inputSize + request.outputSize, '\0');
+        connection.state = ConnectionPaths;
+        return DaemonOk;
+    }
+    if ((request.job != DaemonJobPixels && request.job != DaemonJobShared) || request.width == 0 || request.width > daemonMaxSize ||
+        request.height == 0 || request.height > daemonMaxSize || request.channels < 1 || request.channels > 4) {
+        return DaemonBadRequest;
+    }
+    size_t size = static_cast<size_t>(request.width) * request.height * request.channels;
+    if (request.job == DaemonJobShared && job.fds.size() != 2) {
+        return DaemonBadRequest;
+    }
+    // Shared pixels live in the client's memory, only inline ones count against the limit
+    DaemonStatus admitted = admit(job, request.job == DaemonJobShared ? 0 : size + static_cast<size_t>(request.width) * request.height * 3);
+    if (admitted == DaemonBusy && request.job == DaemonJobPixels) {
+        connection.skipping = size;
+        connection.state = ConnectionSkipping;
+        return DaemonOk;  // Answered DaemonBusy once the payload is skipped, see enqueue
+    }
+    if (admitted != DaemonOk) {
+        return admitted;
+    }
+    // Shared buffers and the socket hold packed rows, the result is allocated packed up front so
+    // reads and cuts land in it and it goes back in one send
+    if (request.job == DaemonJobShared) {
+        job.source.borrow(mapShared(job.fds[0], size, false), request.width, request.height, request.channels);
+        job.result.borrow(mapShared(job.fds[1], static_cast<size_t>(request.width) * request.height * 3, true), request.width, request.height, 3);
+    } else if (!job.source.allocate(request.width, request.height, request.channels, request.width * request.channels) ||
+        !job.result.allocate(request.width, request.height, 3, request.width * 3)) {
+        return DaemonBadRequest;
+    }
+    if (job.source.pixels == nullptr || (request.job == DaemonJobShared && job.result.pixels == nullptr)) {
+        return DaemonBadRequest;
+    }
+    if (request.job == DaemonJobPixels) {
+        connection.state = ConnectionPixels;
+    }
+    return DaemonOk;
+}
+
+// Admits a path job by its header, probed before paying for the decode on a file thread
+DaemonStatus Daemon::pathsReceived(Connection& connection) {
+    PendingJob& job = connection.job;
+    job.input = connection.paths.substr(0, job.request.inputSize);
+    job.output = connection.paths.substr(job.request.inputSize);
+    connection.paths.clear();
+    Image header;
+    if (!header.probe(job.input.c_str())) {
+        return DaemonReadFailed;
+    }
+    // Same limit as inline pixels
+    if (header.width > daemonMaxSize || header.height > daemonMaxSize) {
+        return DaemonBadRequest;
+    }
+    return admit(job, static_cast<size_t>(header.width) * header.height * (header.channels + 3));
+}
+
+// The request is complete: path jobs go to a file thread to be decoded first, the others join
+// the queue, where the ones that failed already are answered on the next round
+void Daemon::enqueue(Connection& connection) {
+    PendingJob& job = connection.job;
+    if (connection.state == ConnectionSkipping) {
+        job.status = DaemonBusy;
+    }
+    if (job.status == DaemonOk && job.request.job == DaemonJobPath) {
+        filesBusy++;
+        fileJobs.push(std::move(job));
+    } else {
+        job.queued = std::chrono::steady_clock::now();
+        pending.push_back(std::move(job));
+    }
+    connection.job = PendingJob();
+    connection.state = ConnectionWaiting;
+    connection.received = 0;
+}
+
+// File thread: decodes path jobs not blurred yet, writes the PNG of blurred ones
+void Daemon::fileLoop() {
+    PendingJob job;
+    while (fileJobs.pop(job)) {
+        if (job.result.pixels == nullptr) {
+            job.status = job.source.read(job.input.c_str()) ? DaemonOk : DaemonReadFailed;
+        } else if (!job.result.write(job.output.c_str())) {
+            job.status = DaemonWriteFailed;
+        }
+        {
+            std::lock_guard<std::mutex> lock(filesMutex);
+            filesDone.push_back(std::move(job));
+        }
+        char wake = 1;
+        ssize_t written = write(wakePipe[1], &wake, 1);  // Full only when a wake is already pending
+        (void)written;
+        job = PendingJob();
+    }
+}
+
+// Takes back what the file threads are done with: decoded jobs join the queue, written ones are answered
+void Daemon::collectFiles() {
+    char drained[64];
+    while (read(wakePipe[0], drained, sizeof(drained)) > 0) {
+    }
+    std::vector<PendingJob> done;
+    {
+        std::lock_guard<std::mutex> lock(filesMutex);
+        done.swap(filesDone);
+    }
+    for (PendingJob& job : done) {
+        filesBusy--;
+        if (job.result.pixels != nullptr) {
+            answer(job);
+        } else {
+            job.queued = std::chrono::steady_clock::now();
+            pending.push_back(std::move(job));
+        }
+    }
+}
+
+// Admission control: a job is queued only while the queue stays under both limits, otherwise it
+// is answered DaemonBusy right away with an estimate of when the backlog will have drained
+DaemonStatus Daemon::admit(PendingJob& job, size_t bytes) {
+    if (bytes > options.maxQueuedBytes) {
+        printf("Daemon: rejecting a job of %zu bytes, over the memory limit\n", bytes);
+        return DaemonBadRequest;
+    }
+    // Jobs still being received or with the file threads are queued too
+    int receiving = static_cast<int>(std::count_if(connections.begin(), connections.end(), [](const Connection& connection) { return connection.state == ConnectionPixels; }));
+    int queued = static_cast<int>(pending.size()) + (tiling ? 1 : 0) + filesBusy + receiving;
+    if (queued >= options.maxQueuedJobs || counters.queuedBytes + bytes > options.maxQueuedBytes) {
+        double megapixels = 0.0;
+        for (const PendingJob& other : pending) {
+            megapixels += static_cast<double>(other.source.width) * other.source.height / 1e6;
+        }
+        if (tiling) {
+            int tileCount = ((tiled.source.width + options.tileSize - 1) / options.tileSize) * ((tiled.source.height + options.tileSize - 1) / options.tileSize);
+            megapixels += static_cast<double>(tiled.source.width) * tiled.source.height / 1e6 * (tileCount - nextTile) / tileCount;
+        }
+        job.retryAfter = std::max(1.0f, static_cast<float>(megapixels * msPerMegapixel));
+        counters.rejected++;
+        return DaemonBusy;
+    }
+    job.bytes = bytes;
+    counters.queuedBytes += bytes;
+    counters.queuedBytesMax = std::max(counters.queuedBytesMax, counters.queuedBytes);
+    return DaemonOk;
+}
+
+bool Daemon::underPressure() {
+    int queued = static_cast<int>(pending.size()) + (tiling ? 1 : 0);
+    return options.degradeAt > 0.0f && (queued >= options.degradeAt * options.maxQueuedJobs ||
+        counters.queuedBytes >= options.degradeAt * options.maxQueuedBytes);
+}
+
+// Keeps a moving average of the GPU time per megapixel, the retry hints are based on it
+void Daemon::measure(std::chrono::steady_clock::time_point begin, long long pixels) {
+    if (pixels > 0) {
+        msPerMegapixel = 0.8f * msPerMegapixel + 0.2f * millisecondsSince(begin) / (pixels / 1e6f);
+    }
+}
+
+// One scheduling round: answers the jobs that can't run, then runs every queued interactive job,
+// or else a single bulk submission so interactive jobs never wait behind more than that
+void Daemon::schedule(bool flush) {
+    TRACE_SCOPE("Daemon::schedule");
+    for (int i = 0; i < pending.size();) {
+        PendingJob& job = pending[i];
+        if (job.status == DaemonOk && job.request.deadline > 0.0f && millisecondsSince(job.arrival) > job.request.deadline) {
+            job.status = DaemonExpired;
+            counters.expired++;
+        }
+        if (job.status != DaemonOk || job.request.job == DaemonJobShutdown) {
+            job.waited = millisecondsSince(job.queued);
+            finish(job);
+            pending.erase(pending.begin() + i);
+        } else {
+            i++;
+        }
+    }
+
+    std::vector<int> interactive = lane(DaemonPriorityInteractive);
+    if (!interactive.empty()) {
+        if (tiling) {
+            counters.preemptions++;
+        }
+        for (const std::vector<int>& group : groupJobs(interactive)) {
+            runGroup(group);
+        }
+        finishJobs(interactive);
+        return;
+    }
+    if (tiling) {
+        runTile();
+        return;
+    }
+    std::vector<int> bulk = lane(DaemonPriorityBulk);
+    if (bulk.empty()) {
+        return;
+    }
+    // Bulk jobs wait for others to coalesce with
+    bool waited = std::any_of(bulk.begin(), bulk.end(), [this](int i) { return millisecondsSince(pending[i].queued) >= options.coalesceWait; });
+    if (!flush && !waited && bulk.size() < options.coalesceMax) {
+        return;
+    }
+    PendingJob& first = pending[bulk[0]];
+    if (first.source.width > options.tileSize || first.source.height > options.tileSize) {
+        tiled = std::move(first);
+        pending.erase(pending.begin() + bulk[0]);
+        tiled.waited = millisecondsSince(tiled.queued);
+        tiled.batch = 1;
+        tiling = true;
+        nextTile = 0;
+        runTile();
+        return;
+    }
+    std::vector<int> group = groupJobs(bulk)[0];
+    runGroup(group);
+    finishJobs(group);
+}
+
+std::vector<int> Daemon::lane(DaemonPriority priority) {
+    std::vector<int> jobs;
+    for (int i = 0; i < pending.size(); i++) {
+        if (pending[i].request.priority == priority) {
+            jobs.push_back(i);
+        }
+    }
+    auto due = [this](int i) {
+        const PendingJob& job = pending[i];
+        return job.request.deadline > 0.0f ? job.arrival + std::chrono::microseconds(static_cast<long long>(job.request.deadline * 1000.0f))
+                                           : std::chrono::steady_clock::time_point::max();
+    };
+    std::stable_sort(jobs.begin(), jobs.end(), [&due](int a, int b) { return due(a) < due(b); });
+    return jobs;
+}
+
+// Jobs with the same radius run the same passes, so small ones are packed into shared atlases.
+// Groups keep the order of jobs, the first one holds jobs[0]
+std::vector<std::vector<int>> Daemon::groupJobs(const std::vector<int>& jobs) {
+    struct Group {
+        float radius;
+        bool coalesce;
+        long long area;  // Atlas area the group already needs, gutters included
+        std::vector<int> jobs;
+    };
+    const long long maxArea = static_cast<long long>(daemonAtlasSize) * daemonAtlasSize / 2;  // Leaves the shelves room
+    std::vector<Group> groups;
+    for (int i : jobs) {
+        const PendingJob& job = pending[i];
+        bool coalesce = job.source.width <= options.coalesceMaxSize && job.source.height <= options.coalesceMaxSize;
+        long long area = static_cast<long long>(job.source.width + 2 * Blurrer::reach) * (job.source.height + 2 * Blurrer::reach);
+        Group* group = nullptr;
+        for (Group& candidate : groups) {
+            if (coalesce && candidate.coalesce && candidate.radius == job.request.radius &&
+                candidate.area + area <= maxArea && candidate.jobs.size() < options.coalesceMax) {
+                group = &candidate;
+                break;
+            }
+        }
+        if (group == nullptr) {
+            groups.push_back({ job.request.radius, coalesce, 0, {} });
+            group = &groups.back();
+        }
+        group->area += area;
+        group->jobs.push_back(i);
+    }
+    std::vector<std::vector<int>> result;
+    for (Group& group : groups) {
+        result.push_back(std::move(group.jobs));
+    }
+    return result;
+}
+
+void Daemon::runGroup(const std::vector<int>& group) {
+    float radius = pending[group[0]].request.radius;
+    bool reduced = underPressure();
+    for (int i : group) {
+        pending[i].waited = millisecondsSince(pending[i].queued);
+        pending[i].reduced = reduced;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    if (group.size() == 1) {
+        PendingJob& job = pending[group[0]];
+        unsigned char* mapped = job.result.pixels;
+        job.batch = 1;
+        int limit = graphics->maxTextureSize();
+        if (job.source.width > limit || job.source.height > limit) {
+            // Over the texture limit, only interactive jobs get here: tiled in one go, bulk ones a tile per step
+            if (job.result.pixels == nullptr && !job.result.allocate(job.source.width, job.source.height, 3)) {
+                job.status = DaemonBlurFailed;
+            }
+            for (int y = 0; y < job.source.height && job.status == DaemonOk; y += options.tileSize) {
+                for (int x = 0; x < job.source.width && job.status == DaemonOk; x += options.tileSize) {
+                    counters.submissions++;
+                    counters.tiles++;
+                    metricsCount("blur_gpu_submissions_total", "kind=\"tile\"");
+                    job.tiles++;
+                    if (!blurrer.blurTile(job.source, x, y, std::min(options.tileSize, job.source.width - x),
+                        std::min(options.tileSize, job.source.height - y), radius, job.result, reduced)) {
+                        job.status = DaemonBlurFailed;
+                    }
+                }
+            }
+        } else {
+            counters.submissions++;
+            metricsCount("blur_gpu_submissions_total", "kind=\"single\"");
+            if (!blurrer.blur(job.source, radius, reduced) || !graphics->readFrame(blurrer.result(), job.result) || (mapped != nullptr && job.result.pixels != mapped)) {
+                job.status = DaemonBlurFailed;
+            }
+        }
+        measure(begin, static_cast<long long>(job.source.width) * job.source.height);
+        return;
+    }
+
+    std::vector<std::pair<int, int>> sizes;
+    std::vector<Image> images(group.size());
+    for (int i = 0; i < group.size(); i++) {
+        const Image& source = pending[group[i]].source;
+        sizes.push_back({ source.width, source.height });
+        images[i].borrow(source.pixels, source.width, source.height, source.channels, source.stride);
+    }
+    Atlas atlas;
+    if (!atlasPack(sizes, Blurrer::reach, daemonAtlasSize, atlas)) {
+        for (int i : group) {
+            runGroup({ i });
+        }
+        return;
+    }
+    Image composed;
+    Image blurred;
+    std::vector<Image> cuts;
+    counters.submissions++;
+    counters.coalescedJobs += group.size();
+    metricsCount("blur_gpu_submissions_total", "kind=\"atlas\"");
+    metricsCount("blur_coalesced_jobs_total", "", static_cast<double>(group.size()));
+    bool ok = atlasCompose(atlas, images, composed) && blurrer.blur(composed, radius, reduced) &&
+        graphics->readFrame(blurrer.result(), blurred) && atlasCut(atlas, blurred, cuts);
+    measure(begin, static_cast<long long>(atlas.width) * atlas.height);
+    for (int i = 0; i < group.size(); i++) {
+        PendingJob& job = pending[group[i]];
+        job.batch = static_cast<int>(group.size());
+        if (!ok) {
+            job.status = DaemonBlurFailed;
+        } else if (job.result.pixels != nullptr) {
+            for (int y = 0; y < cuts[i].height; y++) {
+                memcpy(job.result.row(y), cuts[i].row(y), cuts[i].rowSize());
+            }
+        } else {
+            job.result = std::move(cuts[i]);
+        }
+    }
+}
+
+// One tile of the tiled job per call, rows of tiles from the first row of pixels
+void Daemon::runTile() {
+    PendingJob& job = tiled;
+    int columns = (job.source.width + options.tileSize - 1) / options.tileSize;
+    int rows = (job.source.height + options.tileSize - 1) / options.tileSize;
+    if (nextTile == 0 && job.result.pixels == nullptr && !job.result.allocate(job.source.width, job.source.height, 3)) {
+        job.status = DaemonBlurFailed;
+    }
+    if (nextTile == 0) {
+        job.reduced = underPressure();  // Decided once, mixing kernels would show at the tile seams
+    }
+    if (job.status == DaemonOk) {
+        int x = (nextTile % columns) * options.tileSize;
+        int y = (nextTile / columns) * options.tileSize;
+        int width = std::min(options.tileSize, job.source.width - x);
+        int height = std::min(options.tileSize, job.source.height - y);
+        counters.submissions++;
+        counters.tiles++;
+        metricsCount("blur_gpu_submissions_total", "kind=\"tile\"");
+        job.tiles++;
+        auto begin = std::chrono::steady_clock::now();
+        if (!blurrer.blurTile(job.source, x, y, width, height, job.request.radius, job.result, job.reduced)) {
+            job.status = DaemonBlurFailed;
+        }
+        measure(begin, static_cast<long long>(width) * height);
+        nextTile++;
+    }
+    if (job.status != DaemonOk || nextTile == columns * rows) {
+        finish(job);
+        tiling = false;
+    }
+}
+
+// Answers the jobs at these indices and takes them out of the queue
+void Daemon::finishJobs(std::vector<int> jobs) {
+    for (int i : jobs) {
+        finish(pending[i]);
+    }
+    std::sort(jobs.begin(), jobs.end(), [](int a, int b) { return a > b; });
+    for (int i : jobs) {
+        pending.erase(pending.begin() + i);
+    }
+}
+
+void Daemon::finish(PendingJob& job) {
+    if (job.request.job == DaemonJobPath && job.status == DaemonOk && job.result.pixels != nullptr) {
+        filesBusy++;
+        fileJobs.push(std::move(job));
+        return;
+    }
+    answer(job);
+}
+
+// The connection keeps the job until its answer is all sent, the pixels are sent from its result
+void Daemon::answer(PendingJob& job) {
+    DaemonResponse response = respond(job);
+    Connection* client = connection(job.client);
+    if (client == nullptr) {
+        release(job);
+        return;
+    }
+    client->job = std::move(job);
+    client->response = response;
+    client->sent = 0;
+    client->state = ConnectionAnswering;
+    client->lastActive = std::chrono::steady_clock::now();
+    if (!sendAnswer(*client)) {
+        drop(client->socket);
+    }
+}
+
+// Sends what the socket takes of the answer, then releases the job and goes back to reading
+// requests. False when the client is gone, or must go
+bool Daemon::sendAnswer(Connection& connection) {
+    TRACE_SCOPE("Daemon::sendAnswer");
+    const DaemonResponse& response = connection.response;
+    PendingJob& job = connection.job;
+    bool pixels = (response.status == DaemonOk || response.status == DaemonDegraded) && job.request.job == DaemonJobPixels;
+    size_t total = sizeof(response) + (pixels ? job.result.size() : 0);
+    while (connection.sent < total) {
+        size_t before = connection.sent;
+        if (connection.sent < sizeof(response)) {
+            if (!sendSome(connection.socket, &response, sizeof(response), connection.sent)) {
+                return false;
+            }
+        } else {
+            size_t sentPixels = connection.sent - sizeof(response);
+            if (!sendSome(connection.socket, job.result.pixels, job.result.size(), sentPixels)) {
+                return false;
+            }
+            connection.sent = sizeof(response) + sentPixels;
+        }
+        if (connection.sent == before) {
+            return true;  // Polled for room again
+        }
+        connection.lastActive = std::chrono::steady_clock::now();
+    }
+    release(job);
+    connection.job = PendingJob();
+    connection.state = ConnectionHeader;
+    connection.received = 0;
+    // After a bad request the rest of the stream can't be trusted
+    return response.status != DaemonBadRequest;
+}
+
+// Counts, logs and builds the answer to a job
+DaemonResponse Daemon::respond(PendingJob& job) {
+    const DaemonRequest& request = job.request;
+    DaemonResponse response = { daemonMagic, job.status, 0, 0, 0, 0.0f };
+    if (response.status == DaemonOk && request.job != DaemonJobShutdown) {
+        response.width = job.result.width;
+        response.height = job.result.height;
+        response.channels = 3;
+        if (job.reduced) {
+            response.status = DaemonDegraded;
+            counters.degraded++;
+        }
+    }
+    response.milliseconds = response.status == DaemonBusy ? job.retryAfter : millisecondsSince(job.arrival);
+    counters.jobs++;
+    counters.interactiveJobs += request.priority == DaemonPriorityInteractive;
+    counters.waitTotal += job.waited;
+    counters.waitMax = std::max(counters.waitMax, static_cast<double>(job.waited));
+    const char* lane = request.priority == DaemonPriorityInteractive ? "interactive" : "bulk";
+    if (request.job != DaemonJobShutdown) {
+        metricsCount("blur_jobs_total", std::string("mode=\"daemon\",status=\"") + statusName(response.status) + "\"");
+    }
+    if (response.width > 0) {
+        double pixels = static_cast<double>(response.width) * response.height;
+        metricsCount("blur_pixels_total", "mode=\"daemon\"", pixels);
+        metricsCount("blur_bytes_total", "mode=\"daemon\",direction=\"in\"", pixels * job.source.channels);
+        metricsCount("blur_bytes_total", "mode=\"daemon\",direction=\"out\"", pixels * 3);
+        metricsObserve("blur_queue_wait_seconds", std::string("mode=\"daemon\",lane=\"") + lane + "\"", job.waited / 1e3);
+        metricsObserve("blur_job_seconds", std::string("mode=\"daemon\",lane=\"") + lane + "\"", response.milliseconds / 1e3);
+    }
+    printf("Daemon: job %lld %s type %u status %d %u x %u in %.2f ms, %.2f queued, batch of %d, %d tiles\n", counters.jobs,
+        lane, request.job,
+        response.status, response.width, response.height, response.milliseconds, job.waited, job.batch, job.tiles);
+    if (request.job == DaemonJobShutdown) {
+        stopping = true;
+    }
+    return response;
+}
+
+void Daemon::release(PendingJob& job) {
+    if (job.request.job == DaemonJobShared) {
+        if (job.source.pixels != nullptr) {
+            munmap(job.source.pixels, job.source.size());
+        }
+        if (job.result.pixels != nullptr) {
+            munmap(job.result.pixels, job.result.size());
+        }
+    }
+    job.source.reset();
+    job.result.reset();
+    counters.queuedBytes -= job.bytes;
+    job.bytes = 0;
+    for (int fd : job.fds) {
+        ::close(fd);
+    }
+    job.fds.clear();
+}
+
+#else
+
+bool Daemon::init(Graphics&, const char*, const DaemonOptions&) {
+    printf("Error: the daemon needs Unix domain sockets, not available on this platform\n");
+    return false;
+}
+
+bool Daemon::step() {
+    return false;
+}
+
+void Daemon::close() {
+}
+
+#endif
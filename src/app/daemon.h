@@ -0,0 +1,149 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../graphics/graphics.h"
+#include "../images/images.h"
+#include "blurrer.h"
+#include "protocol.h"
+#include "queue.h"
+
+// Resident blur service on a Unix domain socket, see protocol.h for the wire format
+// The context, the linked programs and the frame pool stay warm between jobs, so a job only
+// costs its transfer and the blur itself. Jobs run on the GL thread
+// Requests are read and answers sent without blocking, each connection picking up where it left
+// off as the socket allows, and path jobs are decoded and encoded on file threads, so neither a
+// stalled client nor a large file holds up the others. A client stuck mid request or mid answer
+// for stallTimeout is dropped
+// Jobs waiting at the same time are coalesced: those with the same radius are packed into one
+// atlas and blurred in a single GPU submission. A bulk job waits at most coalesceWait for others
+// to join, trading that much latency for fewer, larger submissions
+// Two lanes: every step runs all the queued interactive jobs, or else a single bulk submission,
+// a coalesced group or one tile of a large image. An interactive job arriving while a 100 MP
+// bulk image is being blurred waits for one tile, not the whole image
+// Admission is bounded by the number of queued jobs and the pixel memory they hold. Jobs over
+// the limits are rejected at once with a retry hint from the measured throughput, and past
+// degradeAt of either limit jobs are blurred with the reduced kernel to drain the queue faster
+// POSIX only, init fails elsewhere
+
+
+struct DaemonOptions {
+    FrameFormat intermediate = FrameFormat::Rgb10A2;
+    float coalesceWait = 0.0f;  // ms a job may wait for others, 0 only coalesces jobs arriving together
+    int coalesceMax = 16;       // Jobs per submission, reaching it submits without waiting
+    int coalesceMaxSize = 1024; // Larger images are always blurred on their own
+    int tileSize = 1024;        // Larger bulk images are blurred a tile this size per step
+    int maxQueuedJobs = 64;                  // Queued and running jobs, more are answered DaemonBusy
+    size_t maxQueuedBytes = size_t(1) << 30; // Pixel memory they hold, sources and results
+    float degradeAt = 0.0f;                  // Fraction of either limit from which jobs use the reduced kernel, 0 never
+    int fileThreads = 2;                     // Decode path inputs and encode their PNGs
+    int stallTimeout = 10000;                // ms
+};
+
+struct DaemonStats {
+    long long jobs = 0;
+    long long submissions = 0;    // GPU submissions, a coalesced group counts once
+    long long coalescedJobs = 0;  // Jobs that shared their submission
+    double waitTotal = 0.0;       // ms jobs spent queued before their submission
+    double waitMax = 0.0;
+    long long interactiveJobs = 0;
+    long long expired = 0;        // Answered DaemonExpired
+    long long tiles = 0;
+    long long preemptions = 0;    // Interactive submissions that cut into a tiled bulk job
+    long long rejected = 0;       // Answered DaemonBusy
+    long long degraded = 0;       // Answered DaemonDegraded
+    size_t queuedBytes = 0;       // Pixel memory held by queued and running jobs now
+    size_t queuedBytesMax = 0;
+};
+
+class Daemon {
+public:
+    bool init(Graphics& graphics, const char* socketPath, const DaemonOptions& options);
+    bool step();  // Waits a little for jobs and runs them, false once stopped (signal or shutdown job)
+    void close();
+    const DaemonStats& stats() const { return counters; }
+
+private:
+    struct PendingJob {
+        int client;
+        DaemonRequest request;
+        std::vector<int> fds;
+        std::string input;      // DaemonJobPath
+        std::string output;
+        Image source;           // Read, received or mapped (DaemonJobShared) pixels
+        Image result;           // Blurred RGB, mapped for DaemonJobShared
+        DaemonStatus status;    // Set when the job failed before reaching the GPU
+        std::chrono::steady_clock::time_point arrival;  // Request header received
+        std::chrono::steady_clock::time_point queued;   // Payload received too, waiting for a submission
+        float waited;
+        int batch;              // Jobs in its submission
+        int tiles;
+        size_t bytes;           // Counted in queuedBytes until released
+        float retryAfter;       // DaemonBusy hint, ms
+        bool reduced;           // Blurred with the reduced kernel
+    };
+
+    // Where a connection is in its current request. Waiting once the request is complete, until
+    // it's answered: a client sends nothing more until then
+    enum ConnectionState { ConnectionHeader, ConnectionPaths, ConnectionPixels, ConnectionSkipping, ConnectionWaiting, ConnectionAnswering };
+
+    struct Connection {
+        int socket;
+        ConnectionState state = ConnectionHeader;
+        PendingJob job;        // Being received, or answered
+        std::string paths;     // Input then output path, DaemonJobPath
+        size_t received = 0;   // Bytes of the current part so far
+        size_t skipping = 0;   // Payload bytes of a rejected job, ConnectionSkipping
+        DaemonResponse response;
+        size_t sent = 0;       // Bytes of the answer, response then pixels
+        std::chrono::steady_clock::time_point lastActive;
+    };
+
+    Graphics* graphics = nullptr;
+    Blurrer blurrer;
+    DaemonOptions options;
+    DaemonStats counters;
+    std::string socketPath;
+    int listenSocket = -1;
+    int wakePipe[2] = { -1, -1 };     // Written by the file threads when a job is done
+    std::vector<Connection> connections;
+    std::vector<PendingJob> pending;  // At most one per client
+    PendingJob tiled;                 // Bulk job being blurred a tile per step
+    bool tiling = false;
+    int nextTile = 0;
+    bool stopping = false;
+    float msPerMegapixel = 10.0f;  // Recent GPU throughput, for the retry hints
+
+    // Path jobs to decode, or blurred ones to encode, and what the file threads are done with
+    std::vector<std::thread> fileThreads;
+    BoundedQueue<PendingJob> fileJobs;
+    std::mutex filesMutex;
+    std::vector<PendingJob> filesDone;
+    int filesBusy = 0;  // Jobs with the file threads, GL thread only
+
+    Connection* connection(int client);
+    void drop(int client);
+    void dropStalled();
+    bool receive(Connection& connection);  // Reads what has arrived, false when the client is gone or broke the protocol
+    bool sendAnswer(Connection& connection);
+    DaemonStatus beginJob(Connection& connection);
+    DaemonStatus pathsReceived(Connection& connection);
+    void enqueue(Connection& connection);
+    void fileLoop();
+    void collectFiles();
+    DaemonStatus admit(PendingJob& job, size_t bytes);
+    bool underPressure();
+    void measure(std::chrono::steady_clock::time_point begin, long long pixels);
+    void schedule(bool flush);  // flush ignores coalesceWait, used to drain on the way out
+    std::vector<int> lane(DaemonPriority priority);  // Queued jobs of a lane, earliest deadline first
+    std::vector<std::vector<int>> groupJobs(const std::vector<int>& jobs);
+    void runGroup(const std::vector<int>& group);
+    void runTile();
+    void finishJobs(std::vector<int> jobs);
+    void finish(PendingJob& job);  // Answers the job, after writing its PNG on a file thread for DaemonJobPath
+    void answer(PendingJob& job);
+    DaemonResponse respond(PendingJob& job);
+    void release(PendingJob& job);
+};
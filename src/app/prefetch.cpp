@@ -0,0 +1,295 @@
+#include "prefetch.h"
+#include "../trace/trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+
+bool Prefetcher::init(const std::vector<std::string>& inputs, size_t budget, int depth) {
+    this->inputs = inputs;
+    this->budget = budget;
+    this->depth = std::max(depth, 1);
+    slots.resize(inputs.size());
+    if (setupUring(static_cast<unsigned>(this->depth))) {
+        threads.emplace_back(&Prefetcher::uringLoop, this);
+    } else {
+        for (int i = 0; i < this->depth; i++) {
+            threads.emplace_back(&Prefetcher::threadLoop, this);
+        }
+    }
+    return true;
+}
+
+bool Prefetcher::take(int index, std::vector<unsigned char>& data) {
+    if (index >= slots.size()) {
+        return false;
+    }
+    TRACE_SCOPE("Prefetcher::take");
+    std::unique_lock<std::mutex> lock(mutex);
+    Slot& slot = slots[index];
+    changed.wait(lock, [this, &slot]() { return stopping || slot.state == SlotReady || slot.state == SlotFailed; });
+    if (slot.state != SlotReady) {
+        return false;
+    }
+    data = std::move(slot.data);
+    slot.data = {};
+    slot.state = SlotTaken;
+    held -= slot.size;
+    changed.notify_all();
+    return true;
+}
+
+void Prefetcher::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        changed.notify_all();
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+Prefetcher::~Prefetcher() {
+    stop();
+#ifdef __linux__
+    if (uring >= 0) {
+        munmap(sqes, sqesSize);
+        if (cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        close(uring);
+    }
+#endif
+}
+
+bool Prefetcher::reserve(int index, size_t size, bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto ready = [this, index, size]() {
+        return stopping || (index == nextReserve && held + size <= budget);
+    };
+    if (!wait && !ready()) {
+        return false;
+    }
+    changed.wait(lock, ready);
+    if (stopping) {
+        return false;
+    }
+    nextReserve++;
+    held += size;
+    slots[index].size = size;
+    slots[index].state = SlotReading;
+    changed.notify_all();
+    return true;
+}
+
+void Prefetcher::finish(int index, bool ok) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Slot& slot = slots[index];
+    if (!ok) {
+        held -= slot.size;
+        slot.size = 0;
+        slot.data = {};
+    }
+    slot.state = ok ? SlotReady : SlotFailed;
+    changed.notify_all();
+}
+
+// Fallback: every thread reads whole files with plain blocking reads
+void Prefetcher::threadLoop() {
+    for (;;) {
+        int index;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping || nextRead >= inputs.size()) {
+                return;
+            }
+            index = nextRead++;
+        }
+        std::error_code error;
+        size_t size = fs::is_regular_file(inputs[index], error) ? static_cast<size_t>(fs::file_size(inputs[index], error)) : 0;
+        bool readable = !error && size > 0 && size <= budget;
+        if (!reserve(index, readable ? size : 0, true)) {
+            return;
+        }
+        if (!readable) {
+            finish(index, false);
+            continue;
+        }
+        TRACE_SCOPE("Prefetcher::read");
+        Slot& slot = slots[index];
+        slot.data.resize(size);
+        FILE* file = fopen(inputs[index].c_str(), "rb");
+        bool ok = file != nullptr && fread(slot.data.data(), 1, size, file) == size;
+        if (file != nullptr) {
+            fclose(file);
+        }
+        finish(index, ok);
+    }
+}
+
+#ifdef __linux__
+
+bool Prefetcher::setupUring(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+        return false;  // Old kernel, or disabled by seccomp or sysctl
+    }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        close(fd);
+        return false;
+    }
+    char* sq = static_cast<char*>(sqRing);
+    char* cq = static_cast<char*>(cqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    uring = fd;
+    return true;
+}
+
+// Queues a read of the rest of the file, at most depth are in flight so the ring never fills
+bool Prefetcher::submitRead(int index) {
+    Slot& slot = slots[index];
+    unsigned tail = *sqTail;
+    unsigned entry = tail & *sqMask;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes) + entry;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot.fd;
+    sqe->off = slot.done;
+    sqe->addr = reinterpret_cast<unsigned long long>(slot.data.data() + slot.done);
+    sqe->len = static_cast<unsigned>(std::min<size_t>(slot.data.size() - slot.done, 1u << 30));
+    sqe->user_data = static_cast<unsigned long long>(index);
+    sqArray[entry] = entry;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, uring, 1, 0, 0, nullptr, 0) == 1;
+}
+
+// One thread opens the files in order and keeps up to depth reads in flight, blocking in the
+// kernel for completions or on the budget when there's nothing to reap
+void Prefetcher::uringLoop() {
+    int inFlight = 0;
+    int pending = -1;  // Opened, waiting for room in the budget
+    size_t pendingSize = 0;
+    for (;;) {
+        while (inFlight < depth) {
+            if (pending < 0) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (stopping || nextRead >= inputs.size()) {
+                        break;
+                    }
+                    pending = nextRead++;
+                }
+                Slot& slot = slots[pending];
+                slot.fd = open(inputs[pending].c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat info;
+                if (slot.fd >= 0 && (fstat(slot.fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 ||
+                    static_cast<size_t>(info.st_size) > budget)) {
+                    close(slot.fd);
+                    slot.fd = -1;
+                }
+                if (slot.fd < 0) {
+                    // Not a plain file or larger than the whole budget, the decoder reads it itself
+                    if (!reserve(pending, 0, true)) {
+                        break;
+                    }
+                    finish(pending, false);
+                    pending = -1;
+                    continue;
+                }
+                pendingSize = static_cast<size_t>(info.st_size);
+            }
+            if (!reserve(pending, pendingSize, inFlight == 0)) {
+                break;
+            }
+            slots[pending].data.resize(pendingSize);
+            if (!submitRead(pending)) {
+                close(slots[pending].fd);
+                slots[pending].fd = -1;
+                finish(pending, false);
+            } else {
+                inFlight++;
+            }
+            pending = -1;
+        }
+        if (inFlight == 0) {
+            if (pending >= 0) {
+                close(slots[pending].fd);
+                slots[pending].fd = -1;
+            }
+            return;
+        }
+
+        syscall(__NR_io_uring_enter, uring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe* cqe = static_cast<io_uring_cqe*>(cqes) + (head & *cqMask);
+            int index = static_cast<int>(cqe->user_data);
+            int result = cqe->res;
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            Slot& slot = slots[index];
+            if (result > 0) {
+                slot.done += static_cast<size_t>(result);
+                // Short read, queue the rest
+                if (slot.done < slot.data.size() && submitRead(index)) {
+                    continue;
+                }
+            }
+            close(slot.fd);
+            slot.fd = -1;
+            inFlight--;
+            finish(index, result > 0 && slot.done == slot.data.size());
+        }
+    }
+}
+
+#else
+
+bool Prefetcher::setupUring(unsigned entries) {
+    return false;
+}
+
+void Prefetcher::uringLoop() {
+}
+
+bool Prefetcher::submitRead(int index) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads the next input files into memory ahead of the decoders, so a cold disk or a network
+// share costs latency behind the blur instead of stalling every decode. Files are read in input
+// order, at most depth of them in flight and budget bytes held in memory at once. Files larger
+// than the budget are left to the caller. Uses io_uring on Linux, falling back to depth reader
+// threads when it isn't available or on other platforms
+
+
+class Prefetcher {
+public:
+    bool init(const std::vector<std::string>& inputs, size_t budget, int depth);
+    // Blocks until input index is read and hands over its bytes, false when it couldn't be read
+    // (the caller reads it the usual way then). Indices must be taken in increasing order
+    bool take(int index, std::vector<unsigned char>& data);
+    void stop();  // Abandons what's left and joins the threads
+    const char* backend() const { return uring >= 0 ? "io_uring" : "threads"; }
+    ~Prefetcher();
+
+private:
+    enum SlotState { SlotQueued, SlotReading, SlotReady, SlotFailed, SlotTaken };
+    struct Slot {
+        SlotState state = SlotQueued;
+        std::vector<unsigned char> data;
+        size_t size = 0;  // Reserved against the budget
+        size_t done = 0;  // Bytes read so far
+        int fd = -1;
+    };
+
+    std::vector<std::string> inputs;
+    std::vector<Slot> slots;
+    size_t budget = 0;
+    size_t held = 0;  // Bytes of the slots read or being read but not taken yet
+    int depth = 0;
+    int nextRead = 0;     // Next index to start reading
+    int nextReserve = 0;  // Budget is granted in input order, so the oldest file is never starved
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> threads;
+
+    // io_uring rings, mapped from the kernel
+    int uring = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    void* sqes = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    void* cqes = nullptr;
+
+    bool reserve(int index, size_t size, bool wait);  // Waits for its turn and room in the budget
+    void finish(int index, bool ok);
+    void threadLoop();
+    bool setupUring(unsigned entries);
+    void uringLoop();
+    bool submitRead(int index);
+};
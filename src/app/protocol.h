@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+
+// Wire format of the blur daemon (blur --daemon <socket_path>), native byte order as clients
+// are on the same host. A connection carries any number of jobs, answered in order:
+//   request:  DaemonRequest, then inputSize bytes of input path and outputSize bytes of output
+//             path (DaemonJobPath, no terminators) or width * height * channels bytes (DaemonJobPixels)
+//   response: DaemonResponse, then width * height * 3 bytes of blurred pixels for DaemonJobPixels
+// Pixel rows are returned in the order they were sent
+// DaemonJobShared sends no pixels through the socket: the request carries two file descriptors
+// (SCM_RIGHTS, attached to the request header), a memfd holding the input pixels and one of at
+// least width * height * 3 bytes the daemon writes the blurred RGB pixels into. Both must be
+// created with MFD_ALLOW_SEALING and sealed with F_SEAL_SHRINK once sized, or the job is answered
+// DaemonBadRequest: the daemon maps them, and shrinking a mapped object would crash it
+// Interactive jobs run ahead of bulk ones. Within a lane the earliest deadline goes first, and a
+// job still waiting when its deadline passes is answered DaemonExpired without being run
+// The queue is bounded: over its limits a job is answered DaemonBusy at once, with the time to
+// wait before retrying in milliseconds. Under load jobs may come back DaemonDegraded, blurred with
+// a reduced kernel, pixels follow like for DaemonOk
+
+
+const uint32_t daemonMagic = 0x32524c42;  // "BLR2", BLR1 requests had no priority nor deadline
+const uint32_t daemonMaxSize = 16384;     // Width and height limit of inline pixels
+
+enum DaemonJob : uint32_t {
+    DaemonJobPath = 0,      // The daemon reads the input image and writes the blurred PNG
+    DaemonJobPixels = 1,    // Raw 8 bit pixels in, blurred RGB pixels out
+    DaemonJobShutdown = 2,  // Stops the daemon once the response is sent
+    DaemonJobShared = 3,    // Input and output pixels in shared memory passed as descriptors
+};
+
+enum DaemonPriority : uint32_t {
+    DaemonPriorityBulk = 0,         // Coalesced, large images run a tile at a time
+    DaemonPriorityInteractive = 1,  // Never waits for coalescing, preempts bulk jobs between tiles
+};
+
+enum DaemonStatus : int32_t {
+    DaemonOk = 0,
+    DaemonBadRequest = 1,
+    DaemonReadFailed = 2,
+    DaemonBlurFailed = 3,
+    DaemonWriteFailed = 4,
+    DaemonExpired = 5,      // The deadline passed before the job could start
+    DaemonBusy = 6,         // Over the queue limits, try again later
+    DaemonDegraded = 7,     // Done with the reduced kernel
+};
+
+struct DaemonRequest {
+    uint32_t magic;
+    uint32_t job;       // DaemonJob
+    float    radius;
+    uint32_t width;     // DaemonJobPixels
+    uint32_t height;
+    uint32_t channels;  // 1 to 4
+    uint32_t inputSize; // DaemonJobPath
+    uint32_t outputSize;
+    uint32_t priority;  // DaemonPriority
+    float    deadline;  // ms from the request, 0 for none
+};
+
+struct DaemonResponse {
+    uint32_t magic;
+    int32_t  status;    // DaemonStatus
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;  // 3 when pixels follow
+    float    milliseconds;  // Spent on the job inside the daemon, for DaemonBusy the suggested wait before retrying
+};
+
+static_assert(sizeof(DaemonRequest) == 40, "DaemonRequest is part of the wire format");
+static_assert(sizeof(DaemonResponse) == 24, "DaemonResponse is part of the wire format");
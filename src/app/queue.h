@@ -0,0 +1,61 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking queue with a capacity, so a fast producer waits for its consumers instead of piling up
+// work. close() wakes everyone: push then fails, pop drains what is left and then fails
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity = 1) : capacity(capacity) {}
+
+    void setCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->capacity = capacity;
+        notFull.notify_all();
+    }
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+};
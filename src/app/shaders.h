@@ -0,0 +1,7 @@
+#pragma once
+
+// Shader sources, defined in app.cpp and shared with the batch mode
+extern const char* imageVertexSource;
+extern const char* imageFragmentSource;
+extern const char* blurVertexSource;
+extern const char* blurFragmentSource;
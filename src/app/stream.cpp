@@ -0,0 +1,222 @@
+#include "stream.h"
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#include <stdlib.h>
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#else
+    #include <errno.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <unistd.h>
+#endif
+
+
+FILE* streamTakeStdout() {
+    fflush(stdout);
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    FILE* frames = _fdopen(_dup(_fileno(stdout)), "wb");
+    _setmode(_fileno(frames), _O_BINARY);
+    _dup2(_fileno(stderr), _fileno(stdout));
+#else
+    FILE* frames = fdopen(dup(fileno(stdout)), "wb");
+    dup2(fileno(stderr), fileno(stdout));
+#endif
+    return frames;
+}
+
+// Reads up to size bytes of stdin, less at its end or once stop is set. poll wakes every 100 ms
+// to check it, so a stream stopped by its reader going away doesn't hang on a stdin left open
+static size_t readInput(unsigned char* data, size_t size, const std::atomic<bool>& stop) {
+#ifdef _WIN32
+    return fread(data, 1, size, stdin);
+#else
+    size_t got = 0;
+    while (got < size && !stop) {
+        pollfd input = { STDIN_FILENO, POLLIN, 0 };
+        int ready = poll(&input, 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        ssize_t count = read(STDIN_FILENO, data + got, size - got);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        got += static_cast<size_t>(count);
+    }
+    return got;
+#endif
+}
+
+bool Stream::init(Graphics& graphics, FILE* output, int width, int height, int channels, FrameFormat intermediate, float radius) {
+    this->graphics = &graphics;
+    this->output = output;
+    this->width = width;
+    this->height = height;
+    this->channels = channels;
+    this->radius = radius;
+    if (output == nullptr || !blurrer.init(graphics, intermediate) || !blurrer.warmUp()) {
+        return false;
+    }
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);  // A reader going away fails fwrite, and the stream stops
+#endif
+    for (int i = 0; i < readbackCount; i++) {
+        readbacks[i] = graphics.addReadback();
+    }
+    freeInputs.setCapacity(bufferCount);
+    inputs.setCapacity(bufferCount);
+    freeOutputs.setCapacity(bufferCount);
+    outputs.setCapacity(bufferCount);
+    for (int i = 0; i < bufferCount; i++) {
+        // Packed, frames are read and written whole
+        Image input;
+        Image output;
+        if (!input.allocate(width, height, channels, width * channels) || !output.allocate(width, height, channels, width * channels)) {
+            return false;
+        }
+        freeInputs.push(std::move(input));
+        freeOutputs.push(std::move(output));
+    }
+    printf("Stream: %d x %d x %d frames, stdin to stdout\n", width, height, channels);
+    begin = std::chrono::steady_clock::now();
+    reader = std::thread(&Stream::readLoop, this);
+    writer = std::thread(&Stream::writeLoop, this);
+    return true;
+}
+
+void Stream::readLoop() {
+    size_t size = static_cast<size_t>(width) * height * channels;
+    Image frame;
+    while (freeInputs.pop(frame)) {
+        size_t got;
+        {
+            TRACE_SCOPE("Stream::read");
+            got = readInput(frame.pixels, size, stopping);
+        }
+        if (got != size) {
+            if (got != 0 && !stopping) {
+                printf("Stream: dropping a truncated last frame, %zu of %zu bytes\n", got, size);
+            }
+            break;
+        }
+        if (!inputs.push(std::move(frame))) {
+            break;
+        }
+    }
+    inputs.close();
+}
+
+void Stream::writeLoop() {
+    size_t size = static_cast<size_t>(width) * height * channels;
+    Image frame;
+    while (outputs.pop(frame)) {
+        bool written;
+        {
+            TRACE_SCOPE("Stream::write");
+            written = fwrite(frame.pixels, 1, size, output) == size && fflush(output) == 0;
+        }
+        if (!written && !writeFailed) {
+            printf("Stream: stdout closed, stopping\n");
+            writeFailed = true;
+        }
+        freeOutputs.push(std::move(frame));
+    }
+}
+
+void Stream::finishReadback() {
+    Image frame;
+    freeOutputs.pop(frame);
+    bool read = graphics->endReadFrame(readbacks[inFlightFirst], frame);
+    inFlightFirst = (inFlightFirst + 1) % readbackCount;
+    inFlightCount--;
+    if (!read || readFailed) {
+        // The buffer holds an older frame, and skipping one would shift every later frame: stop here
+        if (!readFailed) {
+            printf("Stream: readback failed, stopping\n");
+            metricsCount("blur_jobs_total", "mode=\"stream\",status=\"failed\"");
+        }
+        readFailed = true;
+        blurFailed = true;
+        freeOutputs.push(std::move(frame));
+        return;
+    }
+    outputs.push(std::move(frame));
+    frames++;
+    double pixels = static_cast<double>(width) * height;
+    metricsCount("blur_jobs_total", "mode=\"stream\",status=\"ok\"");
+    metricsCount("blur_pixels_total", "mode=\"stream\"", pixels);
+    metricsCount("blur_bytes_total", "mode=\"stream\",direction=\"in\"", pixels * channels);
+    metricsCount("blur_bytes_total", "mode=\"stream\",direction=\"out\"", pixels * channels);
+}
+
+bool Stream::step() {
+    TRACE_SCOPE("Stream::step");
+    Image frame;
+    if (writeFailed || blurFailed || !inputs.pop(frame)) {
+        while (inFlightCount > 0) {
+            finishReadback();
+        }
+        // Closing every queue unblocks the reader if stdout went away first, and lets the writer drain
+        stopping = true;
+        freeInputs.close();
+        inputs.close();
+        outputs.close();
+#ifdef _WIN32
+        // Nothing interrupts its fread of a stdin left open, the process exits right after anyway
+        if (writeFailed || blurFailed) {
+            reader.detach();
+        } else {
+            reader.join();
+        }
+#else
+        reader.join();
+#endif
+        writer.join();
+        freeOutputs.close();
+        Image left;
+        while (inputs.pop(left) || freeInputs.pop(left) || freeOutputs.pop(left)) {
+            left.reset();
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        fclose(output);
+        return false;
+    }
+    if (inFlightCount == readbackCount) {
+        finishReadback();
+    }
+    if (!blurrer.blur(frame, radius)) {
+        // Reading back now would emit a stale frame, the next step drains the ones in flight and stops
+        printf("Stream: blur failed, stopping\n");
+        metricsCount("blur_jobs_total", "mode=\"stream\",status=\"failed\"");
+        blurFailed = true;
+        freeInputs.push(std::move(frame));
+        return true;
+    }
+    freeInputs.push(std::move(frame));  // The upload already copied it into a pixel buffer
+    int slot = (inFlightFirst + inFlightCount) % readbackCount;
+    if (!graphics->beginReadFrame(readbacks[slot], blurrer.result(), channels == 4 ? 4 : 3)) {
+        printf("Stream: readback failed, stopping\n");
+        metricsCount("blur_jobs_total", "mode=\"stream\",status=\"failed\"");
+        blurFailed = true;
+        return true;
+    }
+    inFlightCount++;
+    metricsSet("blur_queue_depth", "queue=\"stream_input\"", static_cast<double>(inputs.size()));
+    metricsSet("blur_queue_depth", "queue=\"stream_output\"", static_cast<double>(outputs.size()));
+    return true;
+}
+
+void Stream::report() {
+    double megabytes = frames * static_cast<double>(width) * height * channels / 1e6;
+    printf("Stream: %lld frames in %.2f s: %.1f fps, %.1f MB/s each way\n",
+        frames, seconds, seconds > 0 ? frames / seconds : 0.0, seconds > 0 ? megabytes / seconds : 0.0);
+}
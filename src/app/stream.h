@@ -0,0 +1,58 @@
+#pragma once
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "../graphics/graphics.h"
+#include "../images/images.h"
+#include "blurrer.h"
+#include "queue.h"
+
+// Raw video pipe mode, like ffmpeg's rawvideo: fixed size RGB or RGBA frames are read from stdin
+// and written back blurred, same size and layout, to stdout
+//   reader thread (stdin) -> GL thread (upload, blur passes, async readback) -> writer thread (stdout)
+// Frame buffers are recycled through free lists, memory stays constant however long the stream
+
+
+// Points stdout at stderr so logs can't corrupt the stream, and returns the real stdout for frames
+FILE* streamTakeStdout();
+
+class Stream {
+public:
+    bool init(Graphics& graphics, FILE* output, int width, int height, int channels, FrameFormat intermediate, float radius);
+    bool step();  // GL thread: blurs the next frame, false once stdin ended and every frame is out
+    void report();
+
+private:
+    static const int readbackCount = 2;  // Double buffered: one frame read back while the next renders
+    static const int bufferCount = 3;    // Per direction, one for each stage plus one queued
+
+    Graphics* graphics = nullptr;
+    FILE* output = nullptr;
+    int width;
+    int height;
+    int channels;
+    float radius;
+    Blurrer blurrer;
+    std::thread reader;
+    std::thread writer;
+    BoundedQueue<Image> freeInputs;
+    BoundedQueue<Image> inputs;
+    BoundedQueue<Image> freeOutputs;
+    BoundedQueue<Image> outputs;
+    std::atomic<bool> writeFailed{ false };
+    std::atomic<bool> stopping{ false };  // Tells the reader to give up on stdin
+    bool blurFailed = false;  // Or a readback, stops the stream
+    bool readFailed = false;  // Frames still in flight after it are dropped
+    std::chrono::steady_clock::time_point begin;
+    long long frames = 0;
+    double seconds = 0;
+
+    ReadH readbacks[readbackCount];
+    int inFlightFirst = 0;
+    int inFlightCount = 0;
+
+    void readLoop();
+    void writeLoop();
+    void finishReadback();
+};
@@ -0,0 +1,130 @@
+#include "strips.h"
+#include "queue.h"
+#include "../trace/trace.h"
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+static const size_t stripPixels = 4 << 20;  // Rows per strip are picked to hold about this many pixels
+
+struct Strip {
+    int top = 0;     // First row held, reach rows above the first blurred one unless at the top
+    int first = 0;   // First row blurred
+    int rows = 0;    // Rows blurred
+    int height = 0;  // Rows held, including the halo above and below
+    std::vector<unsigned char> pixels;
+};
+
+bool blurStrips(Blurrer& blurrer, int maxSize, const char* input, const char* output, float radius) {
+    TRACE_SCOPE("blurStrips");
+    PnmReader reader;
+    if (!reader.open(input)) {
+        return false;
+    }
+    const int reach = Blurrer::reach;
+    int width = reader.width;
+    int height = reader.height;
+    int channels = reader.channels;
+    int tileWidth = std::min(width, maxSize - 2 * reach);
+    int stripRows = std::max(reach, std::min(static_cast<int>(stripPixels / width), maxSize - 2 * reach));
+    PngWriter writer;
+    if (tileWidth <= 0 || !writer.open(output, width, height, 3)) {
+        return false;
+    }
+    int tiles = (width + tileWidth - 1) / tileWidth;
+    printf("Strips: %s %d x %d, %d rows a strip in %d tiles\n", input, width, height, stripRows, tiles);
+
+    // Two strips queued on each side, so reading and encoding overlap the blur
+    BoundedQueue<Strip> sources(2);
+    BoundedQueue<Strip> blurred(2);
+    std::atomic<bool> failed{ false };
+    auto fail = [&]() {
+        failed = true;
+        sources.close();
+        blurred.close();
+    };
+
+    // Keeps the rows from the top of the next strip's halo down, reading only the new ones
+    std::thread readThread([&]() {
+        size_t rowSize = static_cast<size_t>(width) * channels;
+        std::vector<unsigned char> window;
+        int windowTop = 0;
+        for (int first = 0; first < height; first += stripRows) {
+            int rows = std::min(stripRows, height - first);
+            int top = std::max(0, first - reach);
+            int end = std::min(height, first + rows + reach);
+            window.erase(window.begin(), window.begin() + (top - windowTop) * rowSize);
+            windowTop = top;
+            int held = static_cast<int>(window.size() / rowSize);
+            window.resize((end - top) * rowSize);
+            for (int row = top + held; row < end; row++) {
+                if (!reader.readRow(window.data() + (row - top) * rowSize)) {
+                    printf("Error: %s ends at row %d of %d\n", input, row, height);
+                    fail();
+                    return;
+                }
+            }
+            Strip strip;
+            strip.top = top;
+            strip.first = first;
+            strip.rows = rows;
+            strip.height = end - top;
+            strip.pixels = window;
+            if (!sources.push(std::move(strip))) {
+                return;
+            }
+        }
+        sources.close();
+    });
+
+    std::thread writeThread([&]() {
+        Strip strip;
+        while (blurred.pop(strip)) {
+            TRACE_SCOPE("blurStrips::write");
+            for (int row = 0; row < strip.rows; row++) {
+                if (!writer.writeRow(strip.pixels.data() + static_cast<size_t>(strip.first - strip.top + row) * width * 3)) {
+                    printf("Error writing the image %s\n", output);
+                    fail();
+                    return;
+                }
+            }
+        }
+    });
+
+    // The source and result images only borrow the strips' buffers
+    Strip strip;
+    while (sources.pop(strip)) {
+        Strip out;
+        out.top = strip.top;
+        out.first = strip.first;
+        out.rows = strip.rows;
+        out.height = strip.height;
+        out.pixels.resize(static_cast<size_t>(width) * strip.height * 3);
+        Image source;
+        source.borrow(strip.pixels.data(), width, strip.height, channels);
+        Image result;
+        result.borrow(out.pixels.data(), width, strip.height, 3);
+        bool ok = true;
+        for (int x = 0; x < width && ok; x += tileWidth) {
+            ok = blurrer.blurTile(source, x, strip.first - strip.top, std::min(tileWidth, width - x), strip.rows, radius, result);
+        }
+        if (!ok) {
+            fail();
+            break;
+        }
+        if (!blurred.push(std::move(out))) {
+            break;
+        }
+    }
+    blurred.close();
+    readThread.join();
+    writeThread.join();
+    bool closed = writer.close();
+    if (!failed && !closed) {
+        printf("Error writing the image %s\n", output);
+    }
+    return !failed && closed;
+}
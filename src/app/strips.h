@@ -0,0 +1,13 @@
+#pragma once
+#include "../images/images.h"
+#include "blurrer.h"
+
+// Blurs an image too large to hold in memory or in one texture, a strip of rows at a time, from a
+// row oriented reader into a row oriented encoder:
+//   reader thread (PNM rows) -> GL thread (strip blurred in tiles) -> writer thread (PNG rows)
+// Strips overlap by the blur's reach above and below and are blurred in tiles no wider than
+// maxSize, so memory stays at a few strips of width x (rows + 2 x reach) pixels whatever the height
+// Returns false if the input isn't a binary PPM or PGM, or on a read, blur or write error
+
+
+bool blurStrips(Blurrer& blurrer, int maxSize, const char* input, const char* output, float radius);
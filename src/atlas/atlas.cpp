@@ -0,0 +1,118 @@
+#include "atlas.h"
+#include "../trace/trace.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Shelf packs at a fixed width, returns the height used or -1 if an image is wider than the atlas
+static int shelfPack(const std::vector<std::pair<int, int>>& sizes, const std::vector<int>& order, int gutter, int width, std::vector<AtlasRect>& rects) {
+    int x = 0;
+    int y = 0;
+    int shelfHeight = 0;
+    for (int i : order) {
+        int w = sizes[i].first + 2 * gutter;
+        int h = sizes[i].second + 2 * gutter;
+        if (w > width) {
+            return -1;
+        }
+        if (x + w > width) {
+            y += shelfHeight;
+            x = 0;
+            shelfHeight = 0;
+        }
+        rects[i] = { x + gutter, y + gutter, sizes[i].first, sizes[i].second };
+        x += w;
+        shelfHeight = std::max(shelfHeight, h);
+    }
+    return y + shelfHeight;
+}
+
+bool atlasPack(const std::vector<std::pair<int, int>>& sizes, int gutter, int maxSize, Atlas& atlas) {
+    TRACE_SCOPE("atlasPack");
+    std::vector<int> order(sizes.size());
+    for (int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    // Tallest first keeps the shelves even
+    std::sort(order.begin(), order.end(), [&sizes](int a, int b) {
+        return sizes[a].second != sizes[b].second ? sizes[a].second > sizes[b].second : sizes[a].first > sizes[b].first;
+    });
+
+    // Power of two widths, keep the one with the smallest area
+    long long bestArea = -1;
+    std::vector<AtlasRect> rects(sizes.size());
+    for (int width = 64; width <= maxSize; width *= 2) {
+        int height = shelfPack(sizes, order, gutter, width, rects);
+        if (height < 0 || height > maxSize) {
+            continue;
+        }
+        long long area = static_cast<long long>(width) * height;
+        if (bestArea < 0 || area < bestArea) {
+            bestArea = area;
+            atlas.width = width;
+            atlas.height = height;
+            atlas.rects = rects;
+        }
+    }
+    if (bestArea < 0) {
+        printf("Error: %d images don't fit a %d x %d atlas\n", static_cast<int>(sizes.size()), maxSize, maxSize);
+        return false;
+    }
+    atlas.gutter = gutter;
+    return true;
+}
+
+bool atlasCompose(const Atlas& atlas, const std::vector<Image>& images, Image& out) {
+    TRACE_SCOPE("atlasCompose");
+    if (!out.allocate(atlas.width, atlas.height, 3)) {
+        return false;
+    }
+    memset(out.pixels, 0, out.size());
+    int gutter = atlas.gutter;
+    for (int i = 0; i < images.size(); i++) {
+        const Image& image = images[i];
+        const AtlasRect& rect = atlas.rects[i];
+        // Gutter pixels repeat the nearest edge pixel, like GL_CLAMP_TO_EDGE does for a lone image
+        for (int y = -gutter; y < rect.height + gutter; y++) {
+            int sy = std::min(std::max(y, 0), rect.height - 1);
+            const unsigned char* src = image.row(sy);
+            unsigned char* dst = out.row(rect.y + y) + static_cast<size_t>(rect.x) * 3;
+            for (int x = -gutter; x < rect.width + gutter; x++) {
+                int sx = std::min(std::max(x, 0), rect.width - 1);
+                const unsigned char* p = src + sx * image.channels;
+                unsigned char* q = dst + x * 3;
+                if (image.channels < 3) {
+                    q[0] = q[1] = q[2] = p[0];
+                } else {
+                    q[0] = p[0];
+                    q[1] = p[1];
+                    q[2] = p[2];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool atlasCut(const Atlas& atlas, const Image& blurred, std::vector<Image>& out) {
+    TRACE_SCOPE("atlasCut");
+    if (blurred.width != atlas.width || blurred.height != atlas.height || blurred.channels != 3) {
+        printf("Error: blurred atlas is %d x %d x %d, expected %d x %d x 3\n",
+            blurred.width, blurred.height, blurred.channels, atlas.width, atlas.height);
+        return false;
+    }
+    out.resize(atlas.rects.size());
+    for (int i = 0; i < atlas.rects.size(); i++) {
+        const AtlasRect& rect = atlas.rects[i];
+        Image& image = out[i];
+        if (!image.allocate(rect.width, rect.height, 3)) {
+            return false;
+        }
+        for (int y = 0; y < rect.height; y++) {
+            memcpy(image.row(y), blurred.row(rect.y + y) + static_cast<size_t>(rect.x) * 3, image.rowSize());
+        }
+    }
+    return true;
+}
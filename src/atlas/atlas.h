@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include "../images/images.h"
+
+// Packs many small images into one texture so they share the upload, the blur passes and
+// the readback. Shelf packer: images sorted by height fill rows left to right
+// Every image is surrounded by a gutter of its own edge pixels, wide enough for the blur
+// taps, so the blurred atlas cut back out matches blurring each image on its own
+
+
+struct AtlasRect {
+    int x;       // Image placement in the atlas, gutter excluded
+    int y;
+    int width;
+    int height;
+};
+
+struct Atlas {
+    int width = 0;
+    int height = 0;
+    int gutter = 0;
+    std::vector<AtlasRect> rects;  // Same order as the packed sizes
+};
+
+// sizes are { width, height }. Picks the atlas width wasting the least area, fails when the
+// images don't fit maxSize x maxSize
+bool atlasPack(const std::vector<std::pair<int, int>>& sizes, int gutter, int maxSize, Atlas& atlas);
+
+// 3 channel atlas of the images (gray expanded, alpha dropped) with edge-replicated gutters
+bool atlasCompose(const Atlas& atlas, const std::vector<Image>& images, Image& out);
+
+// Copies every rect of the blurred atlas into its own 3 channel image
+bool atlasCut(const Atlas& atlas, const Image& blurred, std::vector<Image>& out);
@@ -1,11 +1,29 @@
 #include "graphics.h"
-#ifdef _WIN32
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#if defined(_WIN32) || defined(__linux__)
     #include "glad/glad.h"
 #else
     #include <OpenGL/gl.h>
     #include <OpenGL/OpenGL.h>
 #endif
 #include <stdexcept>
+#include <algorithm>
+#include <deque>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef GL_RGBA16F
+    #define GL_RGBA16F 0x881A
+#endif
+#ifndef GL_R11F_G11F_B10F
+    #define GL_R11F_G11F_B10F 0x8C3A
+#endif
+
+#if !defined(GL_ARB_timer_query) && defined(GL_EXT_timer_query)
+    #define GL_TIME_ELAPSED GL_TIME_ELAPSED_EXT
+    #define glGetQueryObjectui64v glGetQueryObjectui64vEXT
+#endif
 
 
 FraH  invFraH  = { -1 };
@@ -14,18 +32,29 @@ UniH  invUniH  = { -1 };
 AttrH invAttrH = { -1 };
 MeshH invMeshH = { -1 };
 TexH  invTexH  = { -1 };
+ReadH invReadH = { -1 };
 
 
 
 struct Frame {
     unsigned int id;
     unsigned int texture;
+    FrameFormat format;
+    int layers;  // 0 for GL_TEXTURE_2D, layered GL_TEXTURE_2D_ARRAY otherwise
     int width;
     int height;
 };
 
 struct Shader {
+    std::string name;
     int program;
+    int vertexShader;
+    int fragmentShader;
+    int geometryShader;
+    int computeShader;
+    bool linked;  // Link status checked and locations resolved
+    std::vector<std::string> uniformNames;
+    std::vector<std::string> attributeNames;
     std::vector<int> uniforms;
     std::vector<int> attributes;
 };
@@ -41,26 +70,80 @@ struct Texture {
     unsigned int id;
     int width;
     int height;
+    int channels;
+    int layers;  // 0 for GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY otherwise
+    unsigned int uploadBuffers[2];  // GL_PIXEL_UNPACK_BUFFER, alternated by updateTexture
+    int nextUploadBuffer;
+};
+
+struct GpuTimer {
+    std::string name;
+    std::vector<double> samples;  // Ring buffer of the latest gpuTimerSamples, in ms
+    int next;
+};
+
+struct Readback {
+    unsigned int buffer;  // GL_PIXEL_PACK_BUFFER
+    size_t capacity;
+    int width;
+    int height;
+    int channels;  // 3 or 4
+    bool pending;
+#ifdef GL_VERSION_3_2
+    GLsync fence;
+#endif
 };
 
+struct GpuQuery {
+    unsigned int id;
+    int timer;
+};
+
+static const int gpuTimerSamples = 256;
+
 class GraphicsState{
 public:
     int width;
     int height;
     int defaultFrameBufferWidth;
     int defaultFrameBufferHeight;
+    bool parallelShaderCompile = false;
+    bool timerQuery = false;
+    bool computeShaders = false;
+    bool textureArrays = false;
+    int maxTextureSize = 0;
+    bool gpuTimers = false;
+    std::vector<GpuTimer> timers;
+    std::deque<GpuQuery> pendingQueries;
+    std::vector<unsigned int> freeQueries;
     std::vector<Shader>  shaders;
     std::vector<Frame>   frames;
     std::vector<Mesh>    meshes;
     std::vector<Texture> textures;
+    std::vector<Readback> readbacks;
 };
 
-static int compileShader(const std::vector<const char*>& defines, const char* source, int* shader, GLenum type) {
+// Compile and link are only issued here, status is checked later in checkShader / checkProgram
+// so the driver can keep compiling (on its own threads with KHR_parallel_shader_compile) meanwhile
+static int issueShader(const std::vector<const char*>& defines, const char* source, GLenum type) {
     int s = glCreateShader(type);
     std::vector<const char*> sources = defines;
     sources.push_back(source);
     glShaderSource(s, static_cast<int>(sources.size()), sources.data(), NULL);
     glCompileShader(s);
+    return s;
+}
+
+static int issueProgram(const std::vector<int>& shaders) {
+    int p = glCreateProgram();
+    for (int s : shaders) {
+        glAttachShader(p, s);
+    }
+    glLinkProgram(p);
+    return p;
+}
+
+static int checkShader(int s) {
     GLint params;
     glGetShaderiv(s, GL_COMPILE_STATUS, &params);
     if (!params) {
@@ -73,15 +156,10 @@ static int compileShader(const std::vector<const char*>& defines, const char* so
         }
         return 0;
     }
-    *shader = s;
     return 1;
 }
 
-static int createProgram(int vertexShader, int fragmentShader, int* program) {
-    int p = glCreateProgram();
-    glAttachShader(p, vertexShader);
-    glAttachShader(p, fragmentShader);
-    glLinkProgram(p);
+static int checkProgram(int p) {
     GLint params;
     glGetProgramiv(p, GL_LINK_STATUS, &params);
     if (!params) {
@@ -94,10 +172,63 @@ static int createProgram(int vertexShader, int fragmentShader, int* program) {
         }
         return 0;
     }
-    *program = p;
     return 1;
 }
 
+// Blocks until the program is linked, then resolves its uniform and attribute locations
+static void linkShader(Shader& shader) {
+    if (shader.linked) {
+        return;
+    }
+    TRACE_SCOPE("linkShader");
+    MetricsScope metricsScope("blur_shader_link_seconds", "");
+    if (shader.vertexShader && !checkShader(shader.vertexShader)) {
+        throw std::runtime_error("Vertex shader compilation failed " + shader.name);
+    }
+    if (shader.fragmentShader && !checkShader(shader.fragmentShader)) {
+        throw std::runtime_error("Fragment shader compilation failed " + shader.name);
+    }
+    if (shader.geometryShader && !checkShader(shader.geometryShader)) {
+        throw std::runtime_error("Geometry shader compilation failed " + shader.name);
+    }
+    if (shader.computeShader && !checkShader(shader.computeShader)) {
+        throw std::runtime_error("Compute shader compilation failed " + shader.name);
+    }
+    if (!checkProgram(shader.program)) {
+        throw std::runtime_error("Create shader program failed " + shader.name);
+    }
+    for (int s : { shader.vertexShader, shader.fragmentShader, shader.geometryShader, shader.computeShader }) {
+        if (s) {
+            glDetachShader(shader.program, s);
+            glDeleteShader(s);
+        }
+    }
+    shader.uniforms.resize(shader.uniformNames.size());
+    shader.attributes.resize(shader.attributeNames.size());
+    for (int i = 0; i < shader.uniformNames.size(); i++) {
+        shader.uniforms[i] = glGetUniformLocation(shader.program, shader.uniformNames[i].c_str());
+    }
+    for (int i = 0; i < shader.attributeNames.size(); i++) {
+        shader.attributes[i] = glGetAttribLocation(shader.program, shader.attributeNames[i].c_str());
+    }
+    shader.linked = true;
+}
+
+// Non-blocking when the driver reports completion status, otherwise the link is only checked on first use
+static bool isShaderDone(const GraphicsState* state, const Shader& shader) {
+    if (shader.linked) {
+        return true;
+    }
+#ifdef GL_KHR_parallel_shader_compile
+    if (state->parallelShaderCompile) {
+        GLint done = 0;
+        glGetProgramiv(shader.program, GL_COMPLETION_STATUS_KHR, &done);
+        return done;
+    }
+#endif
+    return false;
+}
+
 
 Graphics::Graphics(){
     state = new GraphicsState();
@@ -113,69 +244,274 @@ bool Graphics::init(const float windowScaleFactor, const int width, const int he
     state->defaultFrameBufferWidth = width * windowScaleFactor;
     state->defaultFrameBufferHeight = height * windowScaleFactor;
     glViewport(0, 0, width, height);
+#ifdef GL_KHR_parallel_shader_compile
+    // Let the driver pick how many compiler threads to use
+    if (GLAD_GL_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        state->parallelShaderCompile = true;
+    } else if (GLAD_GL_ARB_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+        state->parallelShaderCompile = true;
+    }
+    printf("Parallel shader compile: %d\n", state->parallelShaderCompile);
+#endif
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &state->maxTextureSize);
+#ifdef GL_VERSION_3_2
+    // Layered framebuffers and geometry shaders
+    state->textureArrays = GLAD_GL_VERSION_3_2;
+#endif
+#ifdef GL_ARB_compute_shader
+    state->computeShaders = GLAD_GL_ARB_compute_shader && GLAD_GL_ARB_shader_image_load_store;
+#endif
+#if defined(GL_ARB_timer_query)
+    state->timerQuery = GLAD_GL_VERSION_3_3 || GLAD_GL_ARB_timer_query;
+#elif defined(GL_EXT_timer_query)
+    state->timerQuery = true;
+#endif
     initialized = true;
     return true;
 }
 
-FraH Graphics::addFrame(const int width, const int height) {
-    Frame frame;
-    frame.width = width;
-    frame.height = height;
+static const char* frameFormatName(FrameFormat format) {
+    switch (format) {
+    case FrameFormat::Rgb8:       return "RGB8";
+    case FrameFormat::Rgb10A2:    return "RGB10_A2";
+    case FrameFormat::R11G11B10F: return "R11F_G11F_B10F";
+    case FrameFormat::Rgba16F:    return "RGBA16F";
+    }
+    return "";
+}
+
+static GLint frameInternalFormat(FrameFormat format) {
+    switch (format) {
+    case FrameFormat::Rgb8:       return GL_RGBA8;  // What drivers store GL_RGB as anyway, and image compatible
+    case FrameFormat::Rgb10A2:    return GL_RGB10_A2;
+    case FrameFormat::R11G11B10F: return GL_R11F_G11F_B10F;
+    case FrameFormat::Rgba16F:    return GL_RGBA16F;
+    }
+    return GL_RGB;
+}
+
+// Next format with at least the same precision, Rgb8 is the last resort
+static FrameFormat frameFallbackFormat(FrameFormat format) {
+    switch (format) {
+    case FrameFormat::Rgb10A2:    return FrameFormat::Rgba16F;
+    case FrameFormat::R11G11B10F: return FrameFormat::Rgba16F;
+    default:                      return FrameFormat::Rgb8;
+    }
+}
+
+static bool createFrame(Frame& frame) {
+#ifndef GL_VERSION_3_2
+    if (frame.layers) {
+        printf("Error: layered frames need OpenGL 3.2\n");
+        return false;
+    }
+#endif
+    while (glGetError() != GL_NO_ERROR) {} // Only the errors raised below tell if the format is supported
     glGenFramebuffers(1, &frame.id);
     glBindFramebuffer(GL_FRAMEBUFFER, frame.id);
-    printf("FrameBuffer: %d %d %d\n", frame.id, frame.width, frame.height);
     glGenTextures(1, &frame.texture);
-    glBindTexture(GL_TEXTURE_2D, frame.texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, frame.width, frame.height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, frame.texture, 0);
+    GLenum target = GL_TEXTURE_2D;
+#ifdef GL_VERSION_3_2
+    if (frame.layers) {
+        target = GL_TEXTURE_2D_ARRAY;
+    }
+#endif
+    glBindTexture(target, frame.texture);
+    // No data is uploaded, so the client format and type are just placeholders
+    if (frame.layers) {
+#ifdef GL_VERSION_3_2
+        glTexImage3D(target, 0, frameInternalFormat(frame.format), frame.width, frame.height, frame.layers, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+#endif
+    } else {
+        glTexImage2D(target, 0, frameInternalFormat(frame.format), frame.width, frame.height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    }
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Same edge handling as the source textures, the vertical pass would wrap otherwise
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (frame.layers) {
+#ifdef GL_VERSION_3_2
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, frame.texture, 0);  // Layered, see gl_Layer
+#endif
+    } else {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, frame.texture, 0);
+    }
     GLint status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE) {
-        printf("Framebuffer error! %d\n", status);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (glGetError() != GL_NO_ERROR || status != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Framebuffer error! %s %d\n", frameFormatName(frame.format), status);
+        glDeleteFramebuffers(1, &frame.id);
+        glDeleteTextures(1, &frame.texture);
+        return false;
+    }
+    return true;
+}
+
+// GL addresses rows in whole pixels, so a stride has to be one. Reset to 0 (packed) after use
+static bool setRowLength(GLenum parameter, const Image& image) {
+    if (image.channels <= 0 || image.stride % image.channels != 0) {
+        printf("Error: a stride of %d bytes isn't a whole number of %d byte pixels\n", image.stride, image.channels);
+        return false;
+    }
+    glPixelStorei(parameter, image.packed() ? 0 : image.stride / image.channels);
+    return true;
+}
+
+// Bytes from the first pixel to the last, the last row may have no padding after it
+static size_t imageExtent(const Image& image) {
+    return image.size() - image.stride + image.rowSize();
+}
+
+// Reads land in the image's own rows when it has the right shape (owned or borrowed), in new
+// aligned storage otherwise
+static bool prepareTarget(Image& image, int width, int height, int channels) {
+    if (image.pixels != nullptr && image.width == width && image.height == height && image.channels == channels) {
+        return true;
+    }
+    return image.allocate(width, height, channels);
+}
+
+// Larger textures fail with a GL error and leave an incomplete texture, say why up front instead
+static bool fitsTexture(GraphicsState* state, int width, int height) {
+    if (width > state->maxTextureSize || height > state->maxTextureSize) {
+        printf("Error: %d x %d is over the %d x %d texture size limit, blur it in tiles\n", width, height, state->maxTextureSize, state->maxTextureSize);
+        return false;
+    }
+    return true;
+}
+
+FraH Graphics::addFrame(const int width, const int height, FrameFormat format, const int layers) {
+    if (layers && !state->textureArrays) {
+        printf("Layered frames not supported\n");
         return invFraH;
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    
+    if (!fitsTexture(state, width, height)) {
+        return invFraH;
+    }
+    Frame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.layers = layers;
+    frame.format = format;
+    while (!createFrame(frame)) {
+        if (frame.format == FrameFormat::Rgb8) {
+            return invFraH;
+        }
+        frame.format = frameFallbackFormat(frame.format);
+    }
+    printf("FrameBuffer: %d %d %d %d %s\n", frame.id, frame.width, frame.height, frame.layers, frameFormatName(frame.format));
+
     int idx = static_cast<int>(state->frames.size());
     state->frames.push_back(std::move(frame));
     return FraH { idx };
 }
 
+bool Graphics::resizeFrame(FraH handle, const int width, const int height) {
+    Frame& frame = state->frames[handle.idx];
+    if (frame.width == width && frame.height == height) {
+        return true;
+    }
+    if (!fitsTexture(state, width, height)) {
+        return false;
+    }
+    Frame resized = frame;
+    resized.width = width;
+    resized.height = height;
+    // The format was already validated for this frame, only the size can fail here
+    if (!createFrame(resized)) {
+        return false;
+    }
+    glDeleteFramebuffers(1, &frame.id);
+    glDeleteTextures(1, &frame.texture);
+    frame = resized;
+    return true;
+}
+
+FrameFormat Graphics::frameFormat(FraH frame) {
+    return state->frames[frame.idx].format;
+}
+
+const char* imageFormatQualifier(FrameFormat format) {
+    switch (format) {
+    case FrameFormat::Rgb8:       return "rgba8";
+    case FrameFormat::Rgb10A2:    return "rgb10_a2";
+    case FrameFormat::R11G11B10F: return "r11f_g11f_b10f";
+    case FrameFormat::Rgba16F:    return "rgba16f";
+    }
+    return "";
+}
+
 ShaH Graphics::addShader(
     const std::string& name,
     const char* vertexShader,
     const char* fragmentShader,
     const std::vector<const char*>& defines,
     const std::vector<std::pair<UniH&,  const char*>>& uniformPairings,
-    const std::vector<std::pair<AttrH&, const char*>>& attributePairings
+    const std::vector<std::pair<AttrH&, const char*>>& attributePairings,
+    const char* geometryShader
 ) {
+    TRACE_SCOPE("Graphics::addShader");
     Shader shader;
-    int v, f, p;
-    if (!compileShader(defines, vertexShader, &v, GL_VERTEX_SHADER)) {
-        //printf("Vertex shader compilation failed: %s", name.c_str());
-        throw std::runtime_error("Vertex shader compilation failed " + name);
-    };
-    if (!compileShader(defines, fragmentShader, &f, GL_FRAGMENT_SHADER)) {
-        //printf("Fragment shader compilation failed: %s", name.c_str());
-        throw std::runtime_error("Fragment shader compilation failed " + name);
-    };
-    if (!createProgram(v, f, &p)) {
-        //printf("Create program failed: %s", name.c_str());
-        throw std::runtime_error("Create shader program failed " + name);
-    };
-    shader.program = p;
-    glUseProgram(shader.program);
-    shader.uniforms.resize(uniformPairings.size());
-    shader.attributes.resize(attributePairings.size());
+    shader.name = name;
+    shader.vertexShader = issueShader(defines, vertexShader, GL_VERTEX_SHADER);
+    shader.fragmentShader = issueShader(defines, fragmentShader, GL_FRAGMENT_SHADER);
+    shader.geometryShader = 0;
+#ifdef GL_VERSION_3_2
+    if (geometryShader != nullptr) {
+        shader.geometryShader = issueShader(defines, geometryShader, GL_GEOMETRY_SHADER);
+    }
+#endif
+    shader.computeShader = 0;
+    std::vector<int> stages = { shader.vertexShader, shader.fragmentShader };
+    if (shader.geometryShader) {
+        stages.push_back(shader.geometryShader);
+    }
+    shader.program = issueProgram(stages);
+    shader.linked = false;
+    shader.uniformNames.resize(uniformPairings.size());
+    shader.attributeNames.resize(attributePairings.size());
     for (int i = 0; i < uniformPairings.size(); i++) {
         const auto& pairing = uniformPairings[i];
-        shader.uniforms[i] = glGetUniformLocation(shader.program, pairing.second);
+        shader.uniformNames[i] = pairing.second;
         pairing.first.idx = i;
     }
     for (int i = 0; i < attributePairings.size(); i++) {
         const auto& pairing = attributePairings[i];
-        shader.attributes[i] = glGetAttribLocation(shader.program, pairing.second);
+        shader.attributeNames[i] = pairing.second;
+        pairing.first.idx = i;
+    }
+    int idx = static_cast<int>(state->shaders.size());
+    state->shaders.push_back(std::move(shader));
+    return ShaH{ idx };
+}
+
+ShaH Graphics::addComputeShader(
+    const std::string& name,
+    const char* computeShader,
+    const std::vector<const char*>& defines,
+    const std::vector<std::pair<UniH&, const char*>>& uniformPairings
+) {
+    TRACE_SCOPE("Graphics::addComputeShader");
+    if (!state->computeShaders) {
+        throw std::runtime_error("Compute shaders not supported " + name);
+    }
+    Shader shader;
+    shader.name = name;
+    shader.vertexShader = 0;
+    shader.fragmentShader = 0;
+    shader.geometryShader = 0;
+#ifdef GL_ARB_compute_shader
+    shader.computeShader = issueShader(defines, computeShader, GL_COMPUTE_SHADER);
+#endif
+    shader.program = issueProgram({ shader.computeShader });
+    shader.linked = false;
+    shader.uniformNames.resize(uniformPairings.size());
+    for (int i = 0; i < uniformPairings.size(); i++) {
+        const auto& pairing = uniformPairings[i];
+        shader.uniformNames[i] = pairing.second;
         pairing.first.idx = i;
     }
     int idx = static_cast<int>(state->shaders.size());
@@ -183,6 +519,18 @@ ShaH Graphics::addShader(
     return ShaH{ idx };
 }
 
+bool Graphics::supportsCompute() {
+    return state->computeShaders;
+}
+
+bool Graphics::supportsArrays() {
+    return state->textureArrays;
+}
+
+int Graphics::maxTextureSize() {
+    return state->maxTextureSize;
+}
+
 MeshH Graphics::addMesh(int dimensions, int vertexCount, float* data, int size) {
     Mesh mesh;
     glGenBuffers(1, (GLuint*)&mesh.id);
@@ -196,10 +544,17 @@ MeshH Graphics::addMesh(int dimensions, int vertexCount, float* data, int size)
 }
 
 TexH Graphics::addTexture(const Image& image) {
+    TRACE_SCOPE("Graphics::addTexture");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"upload\"");
+    if (!fitsTexture(state, image.width, image.height)) {
+        return invTexH;
+    }
     Texture texture;
     glGenTextures(1, (GLuint*)&texture.id);
     int glTextureType;
     switch (image.channels) {
+    case 1:     glTextureType = GL_LUMINANCE;       break;  // Gray expands to rgb when sampled
+    case 2:     glTextureType = GL_LUMINANCE_ALPHA; break;
     case 3:     glTextureType = GL_RGB;  break;
     case 4:     glTextureType = GL_RGBA; break;
     default:    glTextureType = GL_RGB;  break;
@@ -211,6 +566,10 @@ TexH Graphics::addTexture(const Image& image) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     // See https://stackoverflow.com/questions/58925604/glteximage2d-crashing-program
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (!setRowLength(GL_UNPACK_ROW_LENGTH, image)) {
+        glDeleteTextures(1, (GLuint*)&texture.id);
+        return invTexH;
+    }
     glTexImage2D(
         GL_TEXTURE_2D,
         0,
@@ -221,12 +580,243 @@ TexH Graphics::addTexture(const Image& image) {
         glTextureType,
         GL_UNSIGNED_BYTE,
         image.pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     glGenerateMipmap(GL_TEXTURE_2D);
     texture.width = image.width;
     texture.height = image.height;
+    texture.channels = image.channels;
+    texture.layers = 0;
+    texture.uploadBuffers[0] = 0;
+    texture.uploadBuffers[1] = 0;
+    texture.nextUploadBuffer = 0;
+    int idx = static_cast<int>(state->textures.size());
+    state->textures.push_back(std::move(texture));
+    return TexH{ idx };
+}
+
+bool Graphics::updateTexture(TexH handle, const Image& image) {
+    TRACE_SCOPE("Graphics::updateTexture");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"upload\"");
+    Texture& texture = state->textures[handle.idx];
+    if (texture.layers > 0) {
+        printf("Error: updateTexture of a texture array\n");
+        return false;
+    }
+    if (!fitsTexture(state, image.width, image.height)) {
+        return false;
+    }
+    int glTextureType;
+    switch (image.channels) {
+    case 1:     glTextureType = GL_LUMINANCE;       break;  // Gray expands to rgb when sampled
+    case 2:     glTextureType = GL_LUMINANCE_ALPHA; break;
+    case 3:     glTextureType = GL_RGB;  break;
+    case 4:     glTextureType = GL_RGBA; break;
+    default:    glTextureType = GL_RGB;  break;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture.id);
+    // Blur taps land on texel centers, replaced textures skip the mipmaps
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (!setRowLength(GL_UNPACK_ROW_LENGTH, image)) {
+        return false;
+    }
+    if (texture.width == image.width && texture.height == image.height && texture.channels == image.channels) {
+        // Same size, stream through a pixel buffer: glBufferData copies the pixels into fresh
+        // storage and returns, the texture copy then runs on the GPU's time instead of ours.
+        // Two buffers alternate so the next copy never lands on one the GPU still reads
+        if (texture.uploadBuffers[0] == 0) {
+            glGenBuffers(2, texture.uploadBuffers);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture.uploadBuffers[texture.nextUploadBuffer]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, imageExtent(image), image.pixels, GL_STREAM_DRAW);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, glTextureType, GL_UNSIGNED_BYTE, reinterpret_cast<void*>(0));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        texture.nextUploadBuffer = 1 - texture.nextUploadBuffer;
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, glTextureType, image.width, image.height, 0, glTextureType, GL_UNSIGNED_BYTE, image.pixels);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    texture.width = image.width;
+    texture.height = image.height;
+    texture.channels = image.channels;
+    return true;
+}
+
+bool Graphics::isShaderReady(ShaH handle) {
+    Shader& shader = state->shaders[handle.idx];
+    if (isShaderDone(state, shader)) {
+        linkShader(shader);
+    }
+    return shader.linked;
+}
+
+void Graphics::pollShaders() {
+    for (Shader& shader : state->shaders) {
+        if (isShaderDone(state, shader)) {
+            linkShader(shader);
+        }
+    }
+}
+
+TexH Graphics::addTextureArray(const std::vector<const Image*>& images) {
+    TRACE_SCOPE("Graphics::addTextureArray");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"upload\"");
+#ifdef GL_VERSION_3_2
+    if (!state->textureArrays || images.empty()) {
+        return invTexH;
+    }
+    const Image& first = *images[0];
+    for (const Image* image : images) {
+        if (image->width != first.width || image->height != first.height || image->channels != first.channels) {
+            printf("Texture array images must share size and channels\n");
+            return invTexH;
+        }
+    }
+    Texture texture;
+    glGenTextures(1, (GLuint*)&texture.id);
+    int glTextureType = first.channels == 4 ? GL_RGBA : GL_RGB;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture.id);
+    // Blur taps land on texel centers, so unlike addTexture no mipmaps are needed
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    int layers = static_cast<int>(images.size());
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, glTextureType, first.width, first.height, layers, 0, glTextureType, GL_UNSIGNED_BYTE, NULL);
+    for (int layer = 0; layer < layers; layer++) {
+        if (setRowLength(GL_UNPACK_ROW_LENGTH, *images[layer])) {
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, first.width, first.height, 1, glTextureType, GL_UNSIGNED_BYTE, images[layer]->pixels);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    texture.width = first.width;
+    texture.height = first.height;
+    texture.channels = first.channels;
+    texture.layers = layers;
+    texture.uploadBuffers[0] = 0;
+    texture.uploadBuffers[1] = 0;
+    texture.nextUploadBuffer = 0;
     int idx = static_cast<int>(state->textures.size());
     state->textures.push_back(std::move(texture));
     return TexH{ idx };
+#else
+    return invTexH;  // Legacy GL headers (macOS) have no texture arrays
+#endif
+}
+
+bool Graphics::readFrame(FraH handle, Image& image) {
+    TRACE_SCOPE("Graphics::readFrame");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"readback\"");
+    Frame& frame = state->frames[handle.idx];
+    if (frame.layers > 0) {
+        printf("Error: readFrame of a layered frame\n");
+        return false;
+    }
+    if (!prepareTarget(image, frame.width, frame.height, 3) || !setRowLength(GL_PACK_ROW_LENGTH, image)) {
+        return false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, frame.id);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, frame.width, frame.height, GL_RGB, GL_UNSIGNED_BYTE, image.pixels);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return true;
+}
+
+ReadH Graphics::addReadback() {
+    Readback readback;
+    glGenBuffers(1, &readback.buffer);
+    readback.capacity = 0;
+    readback.width = 0;
+    readback.height = 0;
+    readback.channels = 3;
+    readback.pending = false;
+#ifdef GL_VERSION_3_2
+    readback.fence = nullptr;
+#endif
+    int idx = static_cast<int>(state->readbacks.size());
+    state->readbacks.push_back(readback);
+    return ReadH{ idx };
+}
+
+bool Graphics::beginReadFrame(ReadH handle, FraH frameHandle, int channels) {
+    TRACE_SCOPE("Graphics::beginReadFrame");
+    Readback& readback = state->readbacks[handle.idx];
+    Frame& frame = state->frames[frameHandle.idx];
+    if (readback.pending || frame.layers > 0 || (channels != 3 && channels != 4)) {
+        printf("Error: beginReadFrame of a pending readback, a layered frame or to %d channels\n", channels);
+        return false;
+    }
+    size_t size = static_cast<size_t>(frame.width) * frame.height * channels;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    if (readback.capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        readback.capacity = size;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, frame.id);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, frame.width, frame.height, channels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, reinterpret_cast<void*>(0));
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#ifdef GL_VERSION_3_2
+    if (GLAD_GL_VERSION_3_2) {
+        readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+#endif
+    readback.width = frame.width;
+    readback.height = frame.height;
+    readback.channels = channels;
+    readback.pending = true;
+    return true;
+}
+
+bool Graphics::isReadDone(ReadH handle) {
+    Readback& readback = state->readbacks[handle.idx];
+#ifdef GL_VERSION_3_2
+    if (readback.pending && readback.fence != nullptr) {
+        GLenum status = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+    }
+#endif
+    return true;  // Without fences only endReadFrame knows, by blocking
+}
+
+bool Graphics::endReadFrame(ReadH handle, Image& image) {
+    TRACE_SCOPE("Graphics::endReadFrame");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"readback\"");
+    Readback& readback = state->readbacks[handle.idx];
+    if (!readback.pending) {
+        printf("Error: endReadFrame without beginReadFrame\n");
+        return false;
+    }
+    readback.pending = false;
+#ifdef GL_VERSION_3_2
+    if (readback.fence != nullptr) {
+        glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(readback.fence);
+        readback.fence = nullptr;
+    }
+#endif
+    if (!prepareTarget(image, readback.width, readback.height, readback.channels)) {
+        return false;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    const unsigned char* mapped = static_cast<const unsigned char*>(glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+    bool mappedOk = mapped != nullptr;
+    if (mappedOk) {
+        // The buffer is packed, padded rows take a copy each
+        if (image.packed()) {
+            memcpy(image.pixels, mapped, image.size());
+        } else {
+            for (int y = 0; y < image.height; y++) {
+                memcpy(image.row(y), mapped + y * image.rowSize(), image.rowSize());
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return mappedOk;
 }
 
 void Graphics::clear() {
@@ -234,41 +824,159 @@ void Graphics::clear() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 }
 
-void Graphics::render(const RenderPass& pass) {
-    Shader& shader = state->shaders[pass.shader.idx];
-    glUseProgram(shader.program);
+static void collectGpuTimes(GraphicsState* state) {
+    // Queries complete in order, stop at the first one still in flight
+    while (!state->pendingQueries.empty()) {
+        GpuQuery query = state->pendingQueries.front();
+        GLint available = 0;
+        glGetQueryObjectiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            break;
+        }
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(query.id, GL_QUERY_RESULT, &nanoseconds);
+        GpuTimer& timer = state->timers[query.timer];
+        metricsObserve("blur_pass_gpu_seconds", "pass=\"" + timer.name + "\"", nanoseconds / 1e9);
+        if (timer.samples.size() < gpuTimerSamples) {
+            timer.samples.push_back(nanoseconds / 1e6);
+        } else {
+            timer.samples[timer.next] = nanoseconds / 1e6;
+            timer.next = (timer.next + 1) % gpuTimerSamples;
+        }
+        state->freeQueries.push_back(query.id);
+        state->pendingQueries.pop_front();
+    }
+}
 
-    if (pass.frame.idx != -1) {
-        const Frame& frame = state->frames[pass.frame.idx];
-        glViewport(0, 0, frame.width, frame.height);
-        glBindFramebuffer(GL_FRAMEBUFFER, frame.id);
-    } else { // Binding to the default FrameBuffer
-        glViewport(0, 0, state->defaultFrameBufferWidth, state->defaultFrameBufferHeight);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+static void beginGpuTimer(GraphicsState* state, const char* name) {
+    collectGpuTimes(state);
+    int timer = 0;
+    while (timer < state->timers.size() && state->timers[timer].name != name) {
+        timer++;
     }
+    if (timer == state->timers.size()) {
+        state->timers.push_back({ name, {}, 0 });
+    }
+    GpuQuery query;
+    if (state->freeQueries.empty()) {
+        glGenQueries(1, &query.id);
+    } else {
+        query.id = state->freeQueries.back();
+        state->freeQueries.pop_back();
+    }
+    query.timer = timer;
+    state->pendingQueries.push_back(query);
+    glBeginQuery(GL_TIME_ELAPSED, query.id);
+}
 
+bool Graphics::enableGpuTimers(bool enable) {
+    if (enable && !state->timerQuery) {
+        printf("GPU timers not supported\n");
+        return false;
+    }
+    state->gpuTimers = enable;
+    return true;
+}
+
+std::vector<GpuTime> Graphics::gpuTimes() {
+    collectGpuTimes(state);
+    std::vector<GpuTime> times;
+    for (const GpuTimer& timer : state->timers) {
+        if (timer.samples.empty()) {
+            continue;
+        }
+        std::vector<double> sorted = timer.samples;
+        std::sort(sorted.begin(), sorted.end());
+        int n = static_cast<int>(sorted.size());
+        times.push_back({ timer.name, sorted[0], sorted[n / 2], sorted[std::min(n - 1, n * 99 / 100)], n });
+    }
+    return times;
+}
+
+static int bytesPerPixel(FrameFormat format) {
+    return format == FrameFormat::Rgba16F ? 8 : 4;  // Drivers pad RGB8 to 4 bytes
+}
+
+void Graphics::publishMetrics() {
+    if (!metricsEnabled()) {
+        return;
+    }
+    double frames = 0.0;
+    for (const Frame& frame : state->frames) {
+        frames += static_cast<double>(frame.width) * frame.height * std::max(1, frame.layers) * bytesPerPixel(frame.format);
+    }
+    double textures = 0.0;
+    double buffers = 0.0;
+    for (const Texture& texture : state->textures) {
+        double size = static_cast<double>(texture.width) * texture.height * texture.channels;
+        textures += size * std::max(1, texture.layers);
+        buffers += texture.uploadBuffers[0] != 0 ? 2.0 * size : 0.0;
+    }
+    for (const Readback& readback : state->readbacks) {
+        buffers += static_cast<double>(readback.capacity);
+    }
+    metricsSet("blur_gpu_memory_bytes", "kind=\"frames\"", frames);
+    metricsSet("blur_gpu_memory_bytes", "kind=\"textures\"", textures);
+    metricsSet("blur_gpu_memory_bytes", "kind=\"pixel_buffers\"", buffers);
+    metricsSet("blur_gpu_frames", "", static_cast<double>(state->frames.size()));
+}
+
+// Pass input is either a texture or the output of another frame
+static void bindInput(GraphicsState* state, TexH texture, FraH frameIn, int textureUnit) {
     int textureId;
-    if (pass.texture.idx != -1) {
-        const auto& texture = state->textures[pass.texture.idx];
-        textureId = texture.id;
+    int layers;
+    if (texture.idx != -1) {
+        textureId = state->textures[texture.idx].id;
+        layers = state->textures[texture.idx].layers;
     } else {
-        const auto& frame = state->frames[pass.frameIn.idx];
-        textureId = frame.texture;
+        textureId = state->frames[frameIn.idx].texture;
+        layers = state->frames[frameIn.idx].layers;
     }
-    glActiveTexture(GL_TEXTURE0 + pass.textureUnit);
+    glActiveTexture(GL_TEXTURE0 + textureUnit);
+#ifdef GL_VERSION_3_2
+    glBindTexture(layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D, textureId);
+#else
     glBindTexture(GL_TEXTURE_2D, textureId);
+#endif
+}
 
-    for (const auto& uniformInt : pass.uniformsInt) {
+static void setUniforms(
+    const Shader& shader,
+    const std::vector<std::pair<UniH, int>>& uniformsInt,
+    const std::vector<std::pair<UniH, float>>& uniformsFloat
+) {
+    for (const auto& uniformInt : uniformsInt) {
         int id = uniformInt.first.idx;
         int value = uniformInt.second;
         glUniform1i(shader.uniforms[id], value);
     }
 
-    for (const auto& uniformFloat : pass.uniformsFloat) {
+    for (const auto& uniformFloat : uniformsFloat) {
         int id = uniformFloat.first.idx;
         float value = uniformFloat.second;
         glUniform1f(shader.uniforms[id], value);
     }
+}
+
+void Graphics::render(const RenderPass& pass) {
+    TRACE_SCOPE("Graphics::render");
+    Shader& shader = state->shaders[pass.shader.idx];
+    linkShader(shader);
+    glUseProgram(shader.program);
+
+    int layers = 0;
+    if (pass.frame.idx != -1) {
+        const Frame& frame = state->frames[pass.frame.idx];
+        glViewport(0, 0, frame.width, frame.height);
+        glBindFramebuffer(GL_FRAMEBUFFER, frame.id);
+        layers = frame.layers;
+    } else { // Binding to the default FrameBuffer
+        glViewport(0, 0, state->defaultFrameBufferWidth, state->defaultFrameBufferHeight);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    bindInput(state, pass.texture, pass.frameIn, pass.textureUnit);
+    setUniforms(shader, pass.uniformsInt, pass.uniformsFloat);
 
     int vertexCount = -1;
     for (const auto& attribute : pass.attributes) {
@@ -289,9 +997,48 @@ void Graphics::render(const RenderPass& pass) {
         );
     }
 
-    glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+    bool timed = state->gpuTimers && pass.name != nullptr;
+    if (timed) {
+        beginGpuTimer(state, pass.name);
+    }
+    if (layers) {
+#ifdef GL_VERSION_3_2
+        // One instance per layer, the geometry shader routes each to gl_Layer = gl_InstanceID
+        glDrawArraysInstanced(GL_TRIANGLES, 0, vertexCount, layers);
+#endif
+    } else {
+        glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+    }
+    if (timed) {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
 
     for (int attr : shader.attributes) {
         glDisableVertexAttribArray(attr);
     }
 }
+
+void Graphics::render(const ComputePass& pass) {
+    TRACE_SCOPE("Graphics::render compute");
+#ifdef GL_ARB_compute_shader
+    Shader& shader = state->shaders[pass.shader.idx];
+    linkShader(shader);
+    glUseProgram(shader.program);
+
+    const Frame& frame = state->frames[pass.frame.idx];
+    glBindImageTexture(pass.imageUnit, frame.texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, frameInternalFormat(frame.format));
+    bindInput(state, pass.texture, pass.frameIn, pass.textureUnit);
+    setUniforms(shader, pass.uniformsInt, pass.uniformsFloat);
+
+    bool timed = state->gpuTimers && pass.name != nullptr;
+    if (timed) {
+        beginGpuTimer(state, pass.name);
+    }
+    glDispatchCompute(pass.groupsX, pass.groupsY, 1);
+    if (timed) {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+    // The output is read next by texture fetches, either from another pass or a blit
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+#endif
+}
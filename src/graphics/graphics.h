@@ -15,6 +15,7 @@ struct UniH  { int idx; };
 struct AttrH { int idx; };
 struct MeshH { int idx; };
 struct TexH  { int idx; };
+struct ReadH { int idx; };
 
 extern FraH  invFraH;
 extern ShaH  invShaH;
@@ -22,9 +23,11 @@ extern UniH  invUniH;
 extern AttrH invAttrH;
 extern MeshH invMeshH;
 extern TexH  invTexH;
+extern ReadH invReadH;
 
 
 struct RenderPass {
+    const char* name;
     FraH frame;
     ShaH shader;
     TexH texture;
@@ -35,6 +38,40 @@ struct RenderPass {
     std::vector<std::pair<AttrH, MeshH>> attributes;
 };
 
+// Storage of a frame's color texture, ordered by bandwidth then precision
+//   Rgb8:       8 bit unorm, the horizontal pass result gets quantized before the vertical pass
+//   Rgb10A2:    10 bit unorm, same bandwidth as Rgb8 and enough headroom for 8 bit images
+//   R11G11B10F: float with 6/6/5 mantissa bits, for range (HDR) rather than precision
+//   Rgba16F:    half float, 11 bits of precision on every channel
+enum class FrameFormat { Rgb8, Rgb10A2, R11G11B10F, Rgba16F };
+
+// Layout qualifier of a frame bound as a compute shader image, e.g. "rgba16f"
+const char* imageFormatQualifier(FrameFormat format);
+
+// Rolling GPU time of the passes sharing a name, in milliseconds
+struct GpuTime {
+    std::string name;
+    double min;
+    double median;
+    double p99;
+    int samples;
+};
+
+// Dispatches a compute shader (GL 4.3 / ARB_compute_shader) writing frame as an image
+struct ComputePass {
+    const char* name;
+    FraH frame;
+    ShaH shader;
+    TexH texture;
+    FraH frameIn;
+    int textureUnit;
+    int imageUnit;
+    int groupsX;
+    int groupsY;
+    std::vector<std::pair<UniH,  int>> uniformsInt;
+    std::vector<std::pair<UniH,  float>> uniformsFloat;
+};
+
 class GraphicsState;
 
 class Graphics {
@@ -44,19 +81,61 @@ public:
     ~Graphics();
     bool init(const float windowScaleFactor, const int width, const int height);
 
-    FraH addFrame(const int width, const int height);
+    // Falls back to the next format holding at least the requested precision when the driver
+    // can't render to it, and to Rgb8 as a last resort. See frameFormat for the one picked
+    // With layers the frame is a layered texture array, passes rendering to it draw one
+    // instance per layer (see addShader's geometryShader)
+    FraH addFrame(const int width, const int height, FrameFormat format = FrameFormat::Rgb8, const int layers = 0);
+    FrameFormat frameFormat(FraH frame);
+    bool resizeFrame(FraH frame, const int width, const int height);  // Keeps the format, drops the content
+    // Only issues compile and link, errors are thrown when the shader is first used or polled
     ShaH addShader(
         const std::string& name,
         const char* vertexShader,
         const char* fragmentShader,
         const std::vector<const char*>& defines,
         const std::vector<std::pair<UniH&,  const char*>>& uniInfos,
-        const std::vector<std::pair<AttrH&, const char*>>& attrInfos
+        const std::vector<std::pair<AttrH&, const char*>>& attrInfos,
+        const char* geometryShader = nullptr
     );
+    ShaH addComputeShader(
+        const std::string& name,
+        const char* computeShader,
+        const std::vector<const char*>& defines,
+        const std::vector<std::pair<UniH&, const char*>>& uniInfos
+    );
+    bool supportsCompute();
+    bool supportsArrays();
+    int maxTextureSize();  // Width and height limit of a texture or frame
+    bool isShaderReady(ShaH shader);  // Never blocks, false until the compile is known to be done
+    void pollShaders();               // Finishes the shaders whose compile is done
     MeshH addMesh(int dimensions, int vertexCount, float* data, int size);
     TexH addTexture(const Image& image);
+    TexH addTextureArray(const std::vector<const Image*>& images);  // Same size and channels, one layer each
+    bool updateTexture(TexH texture, const Image& image);           // Replaces the content, the size may change
+                                                                    // Same size updates stream through pixel buffers
+    // Reads a frame back as 8 bit RGB, rows in the order the images were uploaded. Blocks until the
+    // passes rendering to it are done. Reuses image.pixels when it already has the right size
+    bool readFrame(FraH frame, Image& image);
+    // Asynchronous readFrame through a pixel buffer: begin only queues the copy, done polls its
+    // fence and end maps the buffer into image (blocking if the copy isn't done yet)
+    // Rendering to the frame again right after begin is fine, the copy is ordered before it
+    // channels is 3 (RGB) or 4 (RGBA, alpha is whatever the last pass wrote)
+    ReadH addReadback();
+    bool beginReadFrame(ReadH readback, FraH frame, int channels = 3);
+    bool isReadDone(ReadH readback);
+    bool endReadFrame(ReadH readback, Image& image);
     void clear();
     void render(const RenderPass& pass);
+    void render(const ComputePass& pass);
+
+    // Wraps every pass in a GL_TIME_ELAPSED query. Results are collected without
+    // stalling, a few frames after the pass was issued
+    bool enableGpuTimers(bool enable);
+    std::vector<GpuTime> gpuTimes();
+    // Sets the memory gauges (frames, textures, pixel buffers, estimated from their sizes) when
+    // metrics are on. Pass times go to the metrics as the GPU timers complete
+    void publishMetrics();
     
 private:
     GraphicsState* state;
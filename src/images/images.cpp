@@ -1,24 +1,621 @@
 #include "images.h"
+#include "../metrics/metrics.h"
+#include "../pool/pool.h"
+#include "../trace/trace.h"
+// Decoded pixels come from the pool and go back to it, so same-sized images reuse the buffers
+#define STBI_MALLOC(size)           poolAlloc(size)
+#define STBI_REALLOC(buffer, size)  poolRealloc(buffer, size)
+#define STBI_FREE(buffer)           poolFree(buffer)
 #define STB_IMAGE_IMPLEMENTATION
 #include "../images/stb_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <array>
+#include <filesystem>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-Image::Image() {
-    
+Image::Image(Image&& other) noexcept {
+    *this = std::move(other);
+}
+
+Image& Image::operator=(Image&& other) noexcept {
+    if (this != &other) {
+        reset();
+        width = other.width;
+        height = other.height;
+        channels = other.channels;
+        stride = other.stride;
+        pixels = other.pixels;
+        releasePixels = other.releasePixels;
+        other.pixels = nullptr;
+        other.releasePixels = nullptr;
+    }
+    return *this;
 }
 
 Image::~Image() {
-    if (pixels == nullptr) {
-        free(pixels);
+    reset();
+}
+
+void Image::reset() {
+    if (releasePixels != nullptr && pixels != nullptr) {
+        releasePixels(pixels);
+    }
+    pixels = nullptr;
+    releasePixels = nullptr;
+}
+
+bool Image::allocate(int width, int height, int channels, int stride) {
+    if (stride == 0) {
+        // Multiple of both the alignment and the pixel size
+        int unit = alignment;
+        while (unit % channels != 0) {
+            unit += alignment;
+        }
+        stride = (width * channels + unit - 1) / unit * unit;
+    }
+    if (pixels != nullptr && releasePixels == poolFree && this->width == width && this->height == height &&
+        this->channels == channels && this->stride == stride) {
+        return true;
+    }
+    reset();
+    void* memory = poolAlloc(static_cast<size_t>(stride) * height);
+    if (memory == nullptr) {
+        printf("Error: out of memory for a %d x %d x %d image\n", width, height, channels);
+        return false;
+    }
+    adopt(static_cast<unsigned char*>(memory), width, height, channels, stride, poolFree);
+    return true;
+}
+
+void Image::borrow(unsigned char* pixels, int width, int height, int channels, int stride) {
+    reset();
+    this->pixels = pixels;
+    this->width = width;
+    this->height = height;
+    this->channels = channels;
+    this->stride = stride > 0 ? stride : width * channels;
+}
+
+void Image::adopt(unsigned char* pixels, int width, int height, int channels, int stride, void (*release)(void*)) {
+    borrow(pixels, width, height, channels, stride);
+    releasePixels = release;
+}
+
+bool Image::copyFrom(const Image& other) {
+    if (!allocate(other.width, other.height, other.channels)) {
+        return false;
     }
+    for (int y = 0; y < height; y++) {
+        memcpy(row(y), other.row(y), rowSize());
+    }
+    return true;
+}
+
+bool Image::probe(const char* filename) {
+    if (!stbi_info(filename, &width, &height, &channels)) {
+        printf("Error probing the image\n");
+        return false;
+    }
+    return true;
+}
+
+bool Image::probe(const unsigned char* data, size_t size) {
+    if (size > static_cast<size_t>(INT_MAX) || !stbi_info_from_memory(data, static_cast<int>(size), &width, &height, &channels)) {
+        printf("Error probing the image\n");
+        return false;
+    }
+    return true;
+}
+
+// The whole encoded file, mapped when possible so the decoder reads straight from the page cache
+struct FileView {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    void* mapping = nullptr;
+    std::vector<unsigned char> buffer;  // Fallback when the file can't be mapped
+
+    ~FileView() {
+#ifndef _WIN32
+        if (mapping != nullptr) {
+            munmap(mapping, size);
+        }
+#endif
+    }
+};
+
+static bool readWholeFile(const char* filename, FileView& view) {
+    FILE* file = fopen(filename, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    // One sized read for regular files, chunked for pipes and the like that can't tell their size
+    // (and whatever a regular file grew by since it was measured)
+    std::error_code error;
+    if (std::filesystem::is_regular_file(filename, error)) {
+        uintmax_t size = std::filesystem::file_size(filename, error);
+        if (!error && size <= SIZE_MAX) {
+            view.buffer.resize(static_cast<size_t>(size));
+            view.buffer.resize(fread(view.buffer.data(), 1, view.buffer.size(), file));
+        }
+    }
+    unsigned char chunk[1 << 16];
+    size_t read = 0;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        view.buffer.insert(view.buffer.end(), chunk, chunk + read);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    view.data = view.buffer.data();
+    view.size = view.buffer.size();
+    return ok;
+}
+
+static bool openFileView(const char* filename, FileView& view) {
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            // Decoders walk the file front to back, let the kernel read ahead aggressively
+            madvise(mapping, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+            view.mapping = mapping;
+            view.data = static_cast<const unsigned char*>(mapping);
+            view.size = static_cast<size_t>(info.st_size);
+            close(fd);
+            return true;
+        }
+    }
+    close(fd);
+#endif
+    return readWholeFile(filename, view);
 }
 
 bool Image::read(const char* filename) {
-    stbi_set_flip_vertically_on_load(1);
-    pixels = stbi_load(filename, &width, &height, &channels, 0);
-    if (pixels == NULL) {
+    TRACE_SCOPE("Image::read");
+    FileView view;
+    if (!openFileView(filename, view)) {
+        printf("Error loading the image\n");
+        return false;
+    }
+    return decode(view.data, view.size, filename);
+}
+
+bool Image::decode(const unsigned char* data, size_t size, const char* name) {
+    TRACE_SCOPE("Image::decode");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"decode\"");
+    if (size > static_cast<size_t>(INT_MAX)) {
         printf("Error loading the image\n");
         return false;
     }
-    printf("Image: { %s, %d x %d x %d }\n", filename, width, height, channels);
+    int width, height, channels;
+    unsigned char* decoded = stbi_load_from_memory(data, static_cast<int>(size), &width, &height, &channels, 0);
+    if (decoded == NULL) {
+        printf("Error loading the image\n");
+        return false;
+    }
+    adopt(decoded, width, height, channels, 0, stbi_image_free);
+    printf("Image: { %s, %d x %d x %d }\n", name, width, height, channels);
+    return true;
+}
+
+// Header fields are whitespace separated, comments run from '#' to the end of the line
+static bool pnmField(FILE* file, int& value) {
+    int c = fgetc(file);
+    while (c == '#' || isspace(c)) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+    if (!isdigit(c)) {
+        return false;
+    }
+    value = 0;
+    while (isdigit(c)) {
+        value = value * 10 + (c - '0');
+        if (value > (1 << 24)) {
+            return false;
+        }
+        c = fgetc(file);
+    }
+    return isspace(c) != 0;  // A single whitespace ends the header before the pixels
+}
+
+bool PnmReader::open(const char* filename) {
+    file = fopen(filename, "rb");
+    if (file == nullptr) {
+        printf("Error loading the image %s\n", filename);
+        return false;
+    }
+    char magic[2] = {};
+    int maxValue = 0;
+    if (fread(magic, 1, 2, file) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6') ||
+        !pnmField(file, width) || !pnmField(file, height) || !pnmField(file, maxValue) ||
+        width <= 0 || height <= 0 || maxValue != 255) {
+        printf("Error loading the image %s, not an 8 bit binary PPM or PGM\n", filename);
+        return false;
+    }
+    channels = magic[1] == '6' ? 3 : 1;
     return true;
 }
+
+bool PnmReader::readRow(unsigned char* row) {
+    size_t size = static_cast<size_t>(width) * channels;
+    return file != nullptr && fread(row, 1, size, file) == size;
+}
+
+PnmReader::~PnmReader() {
+    if (file != nullptr) {
+        fclose(file);
+    }
+}
+
+// PNG encoder: adaptive row filters, then zlib with a single fixed Huffman deflate block fed by
+// a hash chain LZ77 matcher. Compresses less than zlib but needs no dependency
+
+static unsigned int pngCrc(const unsigned char* data, size_t size, unsigned int crc = 0xFFFFFFFFu) {
+    static const std::array<unsigned int, 256> table = []() {
+        std::array<unsigned int, 256> t;
+        for (unsigned int n = 0; n < 256; n++) {
+            unsigned int c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+struct BitWriter {
+    std::vector<unsigned char>& out;
+    unsigned int bits = 0;
+    int count = 0;
+
+    BitWriter(std::vector<unsigned char>& out) : out(out) {}
+    void put(unsigned int value, int n) {  // Deflate packs values LSB first
+        bits |= value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(bits & 0xFF);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+    void putCode(unsigned int code, int n) {  // Huffman codes go MSB first
+        unsigned int reversed = 0;
+        for (int i = 0; i < n; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        put(reversed, n);
+    }
+    void flush() {
+        if (count > 0) {
+            out.push_back(bits & 0xFF);
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+static void putLiteralLength(BitWriter& writer, int symbol) {
+    if      (symbol < 144) writer.putCode(0x30 + symbol, 8);
+    else if (symbol < 256) writer.putCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280) writer.putCode(symbol - 256, 7);
+    else                   writer.putCode(0xC0 + symbol - 280, 8);
+}
+
+static void putMatch(BitWriter& writer, int length, int distance) {
+    static const int lengthBase[29]  = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const int distBase[30]    = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const int distExtra[30]   = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    int l = 28;
+    while (lengthBase[l] > length) l--;
+    putLiteralLength(writer, 257 + l);
+    writer.put(length - lengthBase[l], lengthExtra[l]);
+    int d = 29;
+    while (distBase[d] > distance) d--;
+    writer.putCode(d, 5);
+    writer.put(distance - distBase[d], distExtra[d]);
+}
+
+// Streaming deflate: bytes are matched as they come in, keeping the 32 KB window behind the
+// current position and a full match of lookahead ahead of it
+struct Deflater {
+    static const int window = 1 << 15;
+    static const int hashSize = 1 << 15;
+    static const int maxChain = 32;
+    static const int minMatch = 3;
+    static const int maxMatch = 258;
+    std::vector<unsigned char> data;  // Positions below are indices into it, rebased as it slides
+    std::vector<int> head = std::vector<int>(hashSize, -1);
+    std::vector<int> prev = std::vector<int>(window, -1);
+    int position = 0;  // Next byte to encode
+    std::vector<unsigned char> out;
+    BitWriter writer{ out };
+
+    Deflater() {
+        writer.put(1, 1);  // Final block
+        writer.put(1, 2);  // Fixed Huffman codes
+    }
+
+    int hash(int i) const {
+        return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & (hashSize - 1);
+    }
+
+    void insert(int i) {
+        if (i + minMatch <= static_cast<int>(data.size())) {
+            int h = hash(i);
+            prev[i & (window - 1)] = head[h];
+            head[h] = i;
+        }
+    }
+
+    void add(const unsigned char* bytes, size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+        compress(false);
+    }
+
+    // Encodes what has enough lookahead, or everything when finishing
+    void compress(bool finish) {
+        int n = static_cast<int>(data.size());
+        int i = position;
+        while (finish ? i < n : i + maxMatch <= n) {
+            int bestLength = 0;
+            int bestDistance = 0;
+            if (i + minMatch <= n) {
+                int candidate = head[hash(i)];
+                int limit = std::min(maxMatch, n - i);
+                for (int chain = 0; chain < maxChain && candidate >= 0 && i - candidate <= window; chain++) {
+                    int length = 0;
+                    while (length < limit && data[candidate + length] == data[i + length]) {
+                        length++;
+                    }
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = i - candidate;
+                        if (length == limit) {
+                            break;
+                        }
+                    }
+                    int next = prev[candidate & (window - 1)];
+                    if (next >= candidate) {
+                        break;
+                    }
+                    candidate = next;
+                }
+            }
+            if (bestLength >= minMatch) {
+                putMatch(writer, bestLength, bestDistance);
+                for (int k = 0; k < bestLength; k++) {
+                    insert(i + k);
+                }
+                i += bestLength;
+            } else {
+                putLiteralLength(writer, data[i]);
+                insert(i);
+                i++;
+            }
+        }
+        position = i;
+        // Drop what fell out of the window, by whole windows so prev keeps its slots
+        if (position > 2 * window) {
+            int shift = (position - window) / window * window;
+            data.erase(data.begin(), data.begin() + shift);
+            position -= shift;
+            for (int& entry : head) {
+                entry = entry >= shift ? entry - shift : -1;
+            }
+            for (int& entry : prev) {
+                entry = entry >= shift ? entry - shift : -1;
+            }
+        }
+        if (finish) {
+            putLiteralLength(writer, 256);  // End of block
+            writer.flush();
+        }
+    }
+};
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static bool putChunk(FILE* file, const char* type, const unsigned char* data, size_t size) {
+    unsigned char header[8] = {
+        static_cast<unsigned char>(size >> 24), static_cast<unsigned char>(size >> 16),
+        static_cast<unsigned char>(size >> 8),  static_cast<unsigned char>(size),
+        static_cast<unsigned char>(type[0]), static_cast<unsigned char>(type[1]),
+        static_cast<unsigned char>(type[2]), static_cast<unsigned char>(type[3]),
+    };
+    unsigned int crc = pngCrc(header + 4, 4);
+    crc = pngCrc(data, size, crc) ^ 0xFFFFFFFFu;
+    unsigned char trailer[4] = {
+        static_cast<unsigned char>(crc >> 24), static_cast<unsigned char>(crc >> 16),
+        static_cast<unsigned char>(crc >> 8),  static_cast<unsigned char>(crc),
+    };
+    return fwrite(header, 1, 8, file) == 8 && fwrite(data, 1, size, file) == size && fwrite(trailer, 1, 4, file) == 4;
+}
+
+struct PngWriterState {
+    FILE* file = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int rows = 0;
+    bool ok = true;
+    std::vector<unsigned char> previous;  // Unfiltered row above, zeros for the first
+    std::vector<unsigned char> candidate;
+    std::vector<unsigned char> filtered;
+    unsigned int s1 = 1;  // Adler-32 of the filtered bytes
+    unsigned int s2 = 0;
+    Deflater deflater;
+};
+
+static const size_t pngChunkSize = 1 << 20;  // Compressed bytes per IDAT chunk
+
+static void pngFlush(PngWriterState* state, bool all) {
+    std::vector<unsigned char>& out = state->deflater.out;
+    if (out.size() >= pngChunkSize || (all && !out.empty())) {
+        state->ok = state->ok && putChunk(state->file, "IDAT", out.data(), out.size());
+        out.clear();
+    }
+}
+
+bool PngWriter::open(const char* filename, int width, int height, int channels) {
+    static const unsigned char colorTypes[5] = { 0, 0, 4, 2, 6 };  // By channel count
+    if (channels < 1 || channels > 4 || width <= 0 || height <= 0) {
+        printf("Error writing the image, nothing to write\n");
+        return false;
+    }
+    FILE* file = fopen(filename, "wb");
+    if (file == nullptr) {
+        printf("Error writing the image %s\n", filename);
+        return false;
+    }
+    delete state;
+    state = new PngWriterState();
+    state->file = file;
+    state->width = width;
+    state->height = height;
+    state->channels = channels;
+    size_t rowSize = static_cast<size_t>(width) * channels;
+    state->previous.assign(rowSize, 0);
+    state->candidate.resize(rowSize);
+    state->filtered.resize(rowSize + 1);
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    unsigned char header[13] = {
+        static_cast<unsigned char>(width >> 24),  static_cast<unsigned char>(width >> 16),
+        static_cast<unsigned char>(width >> 8),   static_cast<unsigned char>(width),
+        static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+        static_cast<unsigned char>(height >> 8),  static_cast<unsigned char>(height),
+        8, colorTypes[channels], 0, 0, 0,
+    };
+    state->ok = fwrite(signature, 1, 8, file) == 8 && putChunk(file, "IHDR", header, sizeof(header));
+    state->deflater.out.insert(state->deflater.out.begin(), { 0x78, 0x01 });
+    return state->ok;
+}
+
+bool PngWriter::writeRow(const unsigned char* row) {
+    if (state == nullptr || state->rows == state->height) {
+        return false;
+    }
+    // Every row gets the filter with the smallest sum of absolute residuals
+    int channels = state->channels;
+    size_t rowSize = state->previous.size();
+    const unsigned char* up = state->previous.data();
+    unsigned char* out = state->filtered.data();
+    unsigned char* candidate = state->candidate.data();
+    long long bestSum = -1;
+    for (int filter = 0; filter < 5; filter++) {
+        long long sum = 0;
+        for (size_t x = 0; x < rowSize; x++) {
+            int a = x >= channels ? row[x - channels] : 0;
+            int b = up[x];
+            int c = x >= channels ? up[x - channels] : 0;
+            int predicted = 0;
+            switch (filter) {
+            case 1: predicted = a;               break;
+            case 2: predicted = b;               break;
+            case 3: predicted = (a + b) / 2;     break;
+            case 4: predicted = paeth(a, b, c);  break;
+            }
+            candidate[x] = static_cast<unsigned char>(row[x] - predicted);
+            sum += abs(static_cast<signed char>(candidate[x]));
+        }
+        if (bestSum < 0 || sum < bestSum) {
+            bestSum = sum;
+            out[0] = static_cast<unsigned char>(filter);
+            std::copy(candidate, candidate + rowSize, out + 1);
+        }
+    }
+    std::copy(row, row + rowSize, state->previous.begin());
+    for (unsigned char byte : state->filtered) {
+        state->s1 = (state->s1 + byte) % 65521;
+        state->s2 = (state->s2 + state->s1) % 65521;
+    }
+    state->deflater.add(state->filtered.data(), state->filtered.size());
+    pngFlush(state, false);
+    state->rows++;
+    return state->ok;
+}
+
+bool PngWriter::close() {
+    if (state == nullptr) {
+        return false;
+    }
+    bool ok = state->ok && state->rows == state->height;
+    if (ok) {
+        state->deflater.compress(true);
+        unsigned int adler = (state->s2 << 16) | state->s1;
+        state->deflater.out.insert(state->deflater.out.end(), {
+            static_cast<unsigned char>(adler >> 24), static_cast<unsigned char>((adler >> 16) & 0xFF),
+            static_cast<unsigned char>((adler >> 8) & 0xFF), static_cast<unsigned char>(adler & 0xFF),
+        });
+        pngFlush(state, true);
+        ok = state->ok && putChunk(state->file, "IEND", nullptr, 0);
+    }
+    ok = fclose(state->file) == 0 && ok;
+    delete state;
+    state = nullptr;
+    return ok;
+}
+
+PngWriter::~PngWriter() {
+    if (state != nullptr) {
+        fclose(state->file);
+        delete state;
+    }
+}
+
+bool Image::write(const char* filename) const {
+    TRACE_SCOPE("Image::write");
+    MetricsScope metricsScope("blur_stage_seconds", "stage=\"encode\"");
+    if (pixels == nullptr || channels < 1 || channels > 4) {
+        printf("Error writing the image, nothing to write\n");
+        return false;
+    }
+    PngWriter writer;
+    if (!writer.open(filename, width, height, channels)) {
+        return false;
+    }
+    bool written = true;
+    for (int y = 0; y < height && written; y++) {
+        written = writer.writeRow(row(y));
+    }
+    written = writer.close() && written;
+    if (!written) {
+        printf("Error writing the image %s\n", filename);
+    }
+    return written;
+}
@@ -1,13 +1,80 @@
 #pragma once
+#include <stddef.h>
+#include <stdio.h>
 
+// Pixels with an explicit stride, owned by the image unless borrowed. Move only: pixel data is
+// never copied behind the caller's back, copyFrom() does it explicitly. Owned storage allocated
+// here comes from the buffer pool (see pool.h) and starts every row on a 64 byte boundary.
+// Decoded images keep the decoder's packed rows, from the pool too
 class Image {
 public:
+    static const int alignment = 64;
+
     int width = 0;
     int height = 0;
     int channels = 0;
+    int stride = 0;  // Bytes from a row to the next, at least width * channels
     unsigned char* pixels = nullptr;
-    
-    Image();
+
+    Image() = default;
+    Image(Image&& other) noexcept;
+    Image& operator=(Image&& other) noexcept;
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
     ~Image();
+
+    // Owned storage, stride 0 rounds rows up to the alignment (and a whole number of pixels, so
+    // GL can address them). Keeps the current buffer when it's owned and the layout matches
+    bool allocate(int width, int height, int channels, int stride = 0);
+    // Memory owned elsewhere (shared, mapped or pooled), never freed here. stride 0 is packed
+    void borrow(unsigned char* pixels, int width, int height, int channels, int stride = 0);
+    // Takes ownership of pixels, handing them to release when done
+    void adopt(unsigned char* pixels, int width, int height, int channels, int stride, void (*release)(void*));
+    void reset();  // Frees owned pixels, forgets borrowed ones
+    bool copyFrom(const Image& other);  // Same size and channels, owned, this image's stride
+
+    bool owned() const { return releasePixels != nullptr; }
+    bool packed() const { return stride == width * channels; }
+    size_t rowSize() const { return static_cast<size_t>(width) * channels; }
+    size_t size() const { return static_cast<size_t>(stride) * height; }
+    unsigned char* row(int y) const { return pixels + static_cast<size_t>(y) * stride; }
+
+    // Only read the header: width, height and channels, enough to size or reject before decoding
+    bool probe(const char* filename);
+    bool probe(const unsigned char* data, size_t size);
     bool read(const char* filename);
+    bool decode(const unsigned char* data, size_t size, const char* name);  // An encoded file already in memory
+    bool write(const char* filename) const;  // PNG
+
+private:
+    void (*releasePixels)(void*) = nullptr;
+};
+
+// Row at a time PNG encoder, for images too large to hold whole: memory stays at a couple of
+// rows and the deflate window. Rows go top first, compressed data is written as it fills chunks
+struct PngWriterState;
+class PngWriter {
+public:
+    bool open(const char* filename, int width, int height, int channels);
+    bool writeRow(const unsigned char* row);
+    bool close();  // False if any write failed or fewer rows than the height were given
+    ~PngWriter();
+
+private:
+    PngWriterState* state = nullptr;
+};
+
+// Row at a time reader of binary 8 bit PPM (P6) and PGM (P5), the counterpart of PngWriter
+class PnmReader {
+public:
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+
+    bool open(const char* filename);
+    bool readRow(unsigned char* row);  // Top row first, width * channels bytes
+    ~PnmReader();
+
+private:
+    FILE* file = nullptr;
 };
@@ -0,0 +1,135 @@
+// Copyright Joaquin Santoyo Lopez
+#include "app/app.h"
+#include "glad/glad.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <stdio.h>
+#include <string.h>
+
+
+// Headless runs (batch, stream, daemon) need no display server: a surfaceless EGL display when
+// Mesa offers one, else the default display with a small pbuffer. Windowed runs use an X11 window
+static EGLDisplay openDisplay(Display* x11) {
+    if (x11 != NULL) {
+        return eglGetDisplay((EGLNativeDisplayType)x11);
+    }
+    const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (extensions != NULL && strstr(extensions, "EGL_MESA_platform_surfaceless") != NULL && getPlatformDisplay != NULL) {
+        return getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+// After appEntry, which may have started decoding, so appDeinit joins it
+static int fail(const char* message) {
+    printf("Error: %s\n", message);
+    appDeinit();
+    return 1;
+}
+
+int main(int argc, char** argv) {
+
+    if (!appEntry(argc, argv)) {
+        return 1;
+    }
+
+    // Create x11 window
+    Display* x11 = NULL;
+    Window window = 0;
+    Atom deleteMessage = 0;
+    if (!windowInfo.headless) {
+        x11 = XOpenDisplay(NULL);
+        if (x11 == NULL) {
+            return fail("XOpenDisplay failed, is DISPLAY set?");
+        }
+        int screen = DefaultScreen(x11);
+        window = XCreateSimpleWindow(x11, RootWindow(x11, screen), 0, 0, windowInfo.width, windowInfo.height, 0,
+            BlackPixel(x11, screen), BlackPixel(x11, screen));
+        XStoreName(x11, window, "Blur");
+        deleteMessage = XInternAtom(x11, "WM_DELETE_WINDOW", False);
+        XSetWMProtocols(x11, window, &deleteMessage, 1);
+    }
+    windowInfo.scaleFactor = 1;
+
+    // Create opengl context, 4.3 compatibility for the compute passes, else whatever the driver gives
+    EGLDisplay display = openDisplay(x11);
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) {
+        return fail("EGL initialization failed");
+    }
+    EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE, windowInfo.headless ? EGL_PBUFFER_BIT : EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+        return fail("eglChooseConfig failed");
+    }
+    EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT) {
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    }
+    if (context == EGL_NO_CONTEXT) {
+        return fail("eglCreateContext failed");
+    }
+    EGLSurface surface;
+    if (windowInfo.headless) {
+        EGLint surfaceAttributes[] = { EGL_WIDTH, windowInfo.width, EGL_HEIGHT, windowInfo.height, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+    } else {
+        surface = eglCreateWindowSurface(display, config, (EGLNativeWindowType)window, NULL);
+    }
+    if (surface == EGL_NO_SURFACE) {
+        return fail("creating the EGL surface failed");
+    }
+    eglMakeCurrent(display, surface, surface, context);
+    gladLoadGLLoader((GLADloadproc)eglGetProcAddress);
+
+    int running = appInit();
+
+    // Enter window loop. Headless runs never show the window, the app ends the loop
+    if (!windowInfo.headless) {
+        XMapWindow(x11, window);
+    }
+    while (running) {
+        while (x11 != NULL && XPending(x11) > 0) {
+            XEvent event;
+            XNextEvent(x11, &event);
+            if (event.type == ClientMessage && (Atom)event.xclient.data.l[0] == deleteMessage) {
+                running = 0;
+            }
+        }
+        if (windowInfo.headless) {
+            running = running && appRender();
+            continue;
+        }
+        appRender();
+        eglSwapBuffers(display, surface);
+    }
+
+    // Cleanup
+    appDeinit();
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroySurface(display, surface);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+    if (x11 != NULL) {
+        XDestroyWindow(x11, window);
+        XCloseDisplay(x11);
+    }
+    return 0;
+}
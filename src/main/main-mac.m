@@ -55,10 +55,38 @@
 }
 @end
 
+// No window nor run loop, just a context made current on the main thread
+static int runHeadless(void) {
+    @autoreleasepool {
+        NSOpenGLPixelFormatAttribute attributes[] = {
+            NSOpenGLPFAColorSize, 32,
+            NSOpenGLPFAOpenGLProfile, NSOpenGLProfileVersionLegacy,
+            0
+        };
+        NSOpenGLPixelFormat *pixelFormat = [[NSOpenGLPixelFormat alloc] initWithAttributes:attributes];
+        NSOpenGLContext *context = [[NSOpenGLContext alloc] initWithFormat:pixelFormat shareContext:nil];
+        if (context == nil) {
+            NSLog(@"Error: headless context creation failed");
+            return 1;
+        }
+        [context makeCurrentContext];
+        windowInfo.scaleFactor = 1;
+        if (appInit()) {
+            while (appRender()) {}
+        }
+        appDeinit();
+        [NSOpenGLContext clearCurrentContext];
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     if (!appEntry(argc, argv)) {
         return 1;
     }
+    if (windowInfo.headless) {
+        return runHeadless();
+    }
     @autoreleasepool {
         AppDelegate* appDelegate = [[AppDelegate alloc] init];
         NSApplication* app = NSApplication.sharedApplication;
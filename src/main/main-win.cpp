@@ -115,11 +115,12 @@ int main(int argc, char** argv) {
     wglMakeCurrent(windowDevice, windowRenderer);
     gladLoadGL();
 
-    appInit();
+    WPARAM running = appInit();
 
-    // Enter window loop
-    WPARAM running = 1;
-    ShowWindow(windowHandle, SW_SHOWNORMAL);
+    // Enter window loop. Headless runs never show the window, the app ends the loop
+    if (!windowInfo.headless) {
+        ShowWindow(windowHandle, SW_SHOWNORMAL);
+    }
     while (running) {
         MSG msg;
         while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE) > 0) {
@@ -129,6 +130,10 @@ int main(int argc, char** argv) {
             TranslateMessage(&msg);
             DispatchMessage(&msg);
         }
+        if (windowInfo.headless) {
+            running = running && appRender();
+            continue;
+        }
         appRender();
         SwapBuffers(windowDevice);
     }
@@ -0,0 +1,209 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+enum class MetricType {
+    Counter,
+    Gauge,
+    Histogram,
+};
+
+struct MetricSeries {
+    std::string labels;
+    double value;                   // Counter and gauge
+    std::vector<long long> buckets; // Histogram, observations up to each bound, not cumulative yet
+    long long count;
+    double sum;
+};
+
+struct MetricFamily {
+    std::string name;
+    MetricType type;
+    std::string help;
+    std::vector<MetricSeries> series;
+};
+
+// Latency bounds in seconds, from half a millisecond to ten seconds
+static const double metricsBounds[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 };
+static const int metricsBoundCount = sizeof(metricsBounds) / sizeof(metricsBounds[0]);
+
+static std::atomic<bool> metricsOn{ false };
+static std::mutex metricsMutex;
+static std::vector<MetricFamily> metricsFamilies;  // Few of them, found by linear search
+static std::string metricsFile;
+static float metricsInterval;
+static std::thread metricsWriter;
+static std::mutex metricsStopMutex;
+static std::condition_variable metricsStopped;
+static bool metricsStopping = false;
+
+// Callers hold metricsMutex. A family described before its first update takes the type of that update
+static MetricFamily& metricsFamily(const char* name, MetricType type) {
+    for (MetricFamily& family : metricsFamilies) {
+        if (family.name == name) {
+            if (family.series.empty()) {
+                family.type = type;
+            }
+            return family;
+        }
+    }
+    metricsFamilies.push_back({ name, type, "", {} });
+    return metricsFamilies.back();
+}
+
+static MetricSeries& metricsSeries(MetricFamily& family, const std::string& labels) {
+    for (MetricSeries& series : family.series) {
+        if (series.labels == labels) {
+            return series;
+        }
+    }
+    family.series.push_back({ labels, 0.0, std::vector<long long>(metricsBoundCount, 0), 0, 0.0 });
+    return family.series.back();
+}
+
+static void metricsWriteLabels(FILE* file, const std::string& labels, const char* extra) {
+    if (labels.empty() && extra == nullptr) {
+        return;
+    }
+    fprintf(file, "{%s%s%s}", labels.c_str(), !labels.empty() && extra != nullptr ? "," : "", extra != nullptr ? extra : "");
+}
+
+// Rewritten through a temporary file and a rename, readers never see half a snapshot
+static bool metricsWrite() {
+    std::string temporary = metricsFile + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (file == nullptr) {
+        printf("Error opening metrics file %s\n", temporary.c_str());
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(metricsMutex);
+        for (const MetricFamily& family : metricsFamilies) {
+            const char* type = family.type == MetricType::Counter ? "counter" : family.type == MetricType::Gauge ? "gauge" : "histogram";
+            if (!family.help.empty()) {
+                fprintf(file, "# HELP %s %s\n", family.name.c_str(), family.help.c_str());
+            }
+            fprintf(file, "# TYPE %s %s\n", family.name.c_str(), type);
+            for (const MetricSeries& series : family.series) {
+                if (family.type != MetricType::Histogram) {
+                    fprintf(file, "%s", family.name.c_str());
+                    metricsWriteLabels(file, series.labels, nullptr);
+                    fprintf(file, " %.17g\n", series.value);
+                    continue;
+                }
+                long long cumulative = 0;
+                char bound[32];
+                for (int i = 0; i < metricsBoundCount; i++) {
+                    cumulative += series.buckets[i];
+                    snprintf(bound, sizeof(bound), "le=\"%g\"", metricsBounds[i]);
+                    fprintf(file, "%s_bucket", family.name.c_str());
+                    metricsWriteLabels(file, series.labels, bound);
+                    fprintf(file, " %lld\n", cumulative);
+                }
+                fprintf(file, "%s_bucket", family.name.c_str());
+                metricsWriteLabels(file, series.labels, "le=\"+Inf\"");
+                fprintf(file, " %lld\n", series.count);
+                fprintf(file, "%s_sum", family.name.c_str());
+                metricsWriteLabels(file, series.labels, nullptr);
+                fprintf(file, " %.17g\n", series.sum);
+                fprintf(file, "%s_count", family.name.c_str());
+                metricsWriteLabels(file, series.labels, nullptr);
+                fprintf(file, " %lld\n", series.count);
+            }
+        }
+    }
+    fclose(file);
+#ifdef _WIN32
+    remove(metricsFile.c_str());  // rename doesn't replace on Windows
+#endif
+    if (rename(temporary.c_str(), metricsFile.c_str()) != 0) {
+        printf("Error replacing metrics file %s\n", metricsFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool metricsStart(const char* filename, float interval) {
+    metricsFile = filename;
+    metricsInterval = interval > 0.0f ? interval : 5.0f;
+    metricsOn = true;
+    if (!metricsWrite()) {
+        metricsOn = false;
+        return false;
+    }
+    metricsWriter = std::thread([]() {
+        std::unique_lock<std::mutex> lock(metricsStopMutex);
+        while (!metricsStopped.wait_for(lock, std::chrono::duration<float>(metricsInterval), []() { return metricsStopping; })) {
+            metricsWrite();
+        }
+    });
+    printf("Metrics: %s every %.1f s\n", filename, metricsInterval);
+    return true;
+}
+
+void metricsStop() {
+    if (!metricsOn) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(metricsStopMutex);
+        metricsStopping = true;
+    }
+    metricsStopped.notify_all();
+    metricsWriter.join();
+    metricsWrite();
+    metricsOn = false;
+}
+
+bool metricsEnabled() {
+    return metricsOn;
+}
+
+void metricsDescribe(const char* name, const char* help) {
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    metricsFamily(name, MetricType::Counter).help = help;
+}
+
+void metricsCount(const char* name, const std::string& labels, double value) {
+    if (!metricsOn) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    metricsSeries(metricsFamily(name, MetricType::Counter), labels).value += value;
+}
+
+void metricsSet(const char* name, const std::string& labels, double value) {
+    if (!metricsOn) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    metricsSeries(metricsFamily(name, MetricType::Gauge), labels).value = value;
+}
+
+void metricsObserve(const char* name, const std::string& labels, double seconds) {
+    if (!metricsOn) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    MetricSeries& series = metricsSeries(metricsFamily(name, MetricType::Histogram), labels);
+    int bucket = 0;
+    while (bucket < metricsBoundCount && seconds > metricsBounds[bucket]) {
+        bucket++;
+    }
+    if (bucket < metricsBoundCount) {
+        series.buckets[bucket]++;
+    }
+    series.count++;
+    series.sum += seconds;
+}
+
+MetricsScope::~MetricsScope() {
+    if (metricsOn) {
+        metricsObserve(name, labels, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+}
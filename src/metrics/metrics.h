@@ -0,0 +1,27 @@
+#pragma once
+#include <chrono>
+#include <string>
+
+// Counters, gauges and latency histograms in the Prometheus text exposition format, rewritten to
+// a file every interval (for node_exporter's textfile collector, or anything that scrapes a file)
+// Off until metricsStart, updates are then a mutex and a short lookup, meant per job or stage,
+// not per pixel. labels is the inside of the braces, e.g. stage="decode", or "" for none
+
+
+bool metricsStart(const char* filename, float interval);  // Starts the writer thread
+void metricsStop();                                       // Writes a last time and stops it
+bool metricsEnabled();
+
+void metricsDescribe(const char* name, const char* help);  // # HELP line, optional
+void metricsCount(const char* name, const std::string& labels, double value = 1.0);
+void metricsSet(const char* name, const std::string& labels, double value);
+void metricsObserve(const char* name, const std::string& labels, double seconds);
+
+// Observes its lifetime in seconds
+struct MetricsScope {
+    const char* name;
+    const char* labels;
+    std::chrono::steady_clock::time_point begin;
+    MetricsScope(const char* name, const char* labels) : name(name), labels(labels), begin(std::chrono::steady_clock::now()) {}
+    ~MetricsScope();
+};
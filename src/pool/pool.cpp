@@ -0,0 +1,237 @@
+#include "pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+static const size_t headerSize = 64;        // In front of every buffer, keeps it 64 byte aligned
+static const size_t minPooled = 64 << 10;
+static const size_t hugePage = 2 << 20;
+static const int classCount = 4 * 40;       // Up to 64 KB << 40
+static const int threadSlots = 2;           // Buffers of each class a thread keeps to itself
+static const size_t threadLimit = 64 << 20; // And bytes in all
+static const size_t sharedLimit = static_cast<size_t>(512) << 20;  // Past that freed buffers go back to the system
+
+enum BufferKind { BufferHeap, BufferMapped };
+
+struct Header {
+    size_t capacity;  // Usable bytes after the header
+    size_t mapped;    // Length of the mapping, BufferMapped only
+    int sizeClass;    // -1 when not pooled: small, or larger than the last class
+    int kind;
+};
+static_assert(sizeof(Header) <= headerSize, "the header must fit in front of the buffer");
+
+struct SharedLists {
+    std::mutex mutex;
+    std::vector<void*> buffers[classCount];
+    size_t held = 0;
+};
+
+// Never destroyed: images in static objects are freed after every other static is gone
+static SharedLists& shared() {
+    static SharedLists* lists = new SharedLists();
+    return *lists;
+}
+
+static void releaseToShared(void* buffer);
+
+// Buffers a thread keeps to itself. The first use in a thread constructs it, which registers the
+// destructor that hands them to the shared lists when the thread exits
+struct ThreadCache {
+    void* slots[classCount][threadSlots] = {};
+    int counts[classCount] = {};
+    size_t bytes = 0;
+    ~ThreadCache();
+};
+static thread_local ThreadCache cache;
+// Trivially destructible, so frees from static destructors run after the cache is gone still see
+// it's closed and never touch it
+static thread_local bool cacheClosed = false;
+
+ThreadCache::~ThreadCache() {
+    cacheClosed = true;
+    for (int index = 0; index < classCount; index++) {
+        while (counts[index] > 0) {
+            releaseToShared(slots[index][--counts[index]]);
+        }
+    }
+    bytes = 0;
+}
+
+static std::atomic<long long> reused{ 0 };
+static std::atomic<long long> allocated{ 0 };
+
+static Header* headerOf(void* buffer) {
+    return reinterpret_cast<Header*>(static_cast<char*>(buffer) - headerSize);
+}
+
+static size_t classBytes(int index) {
+    if (index == 0) {
+        return minPooled;
+    }
+    size_t base = minPooled << ((index - 1) / 4);
+    return base + base * ((index - 1) % 4 + 1) / 4;
+}
+
+static int classOf(size_t size) {
+    int index = 0;
+    while (index < classCount && classBytes(index) < size) {
+        index++;
+    }
+    return index < classCount ? index : -1;
+}
+
+// Header and buffer in one block, from the system
+static Header* systemAlloc(size_t capacity) {
+    size_t size = headerSize + capacity;
+    Header* header = nullptr;
+    int kind = BufferHeap;
+    size_t mapped = 0;
+#ifdef __linux__
+    if (size >= hugePage) {
+        // Mapped a huge page over and trimmed, so it starts on a huge page boundary
+        size_t length = (size + hugePage - 1) / hugePage * hugePage;
+        void* mapping = mmap(nullptr, length + hugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+        char* begin = static_cast<char*>(mapping);
+        char* start = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(begin) + hugePage - 1) / hugePage * hugePage);
+        if (start > begin) {
+            munmap(begin, start - begin);
+        }
+        if (begin + hugePage > start) {
+            munmap(start + length, begin + hugePage - start);
+        }
+        madvise(start, length, MADV_HUGEPAGE);  // Only a hint, THP may be off
+        header = reinterpret_cast<Header*>(start);
+        kind = BufferMapped;
+        mapped = length;
+    }
+#endif
+    if (header == nullptr) {
+#ifdef _WIN32
+        header = static_cast<Header*>(_aligned_malloc(size, headerSize));
+#else
+        void* memory = nullptr;
+        header = posix_memalign(&memory, headerSize, size) == 0 ? static_cast<Header*>(memory) : nullptr;
+#endif
+        if (header == nullptr) {
+            return nullptr;
+        }
+    }
+    header->capacity = capacity;
+    header->mapped = mapped;
+    header->kind = kind;
+    header->sizeClass = -1;
+    return header;
+}
+
+static void systemFree(Header* header) {
+#ifdef __linux__
+    if (header->kind == BufferMapped) {
+        munmap(header, header->mapped);
+        return;
+    }
+#endif
+#ifdef _WIN32
+    _aligned_free(header);
+#else
+    free(header);
+#endif
+}
+
+static void releaseToShared(void* buffer) {
+    Header* header = headerOf(buffer);
+    SharedLists& lists = shared();
+    {
+        std::lock_guard<std::mutex> lock(lists.mutex);
+        if (lists.held + header->capacity <= sharedLimit) {
+            lists.buffers[header->sizeClass].push_back(buffer);
+            lists.held += header->capacity;
+            return;
+        }
+    }
+    systemFree(header);
+}
+
+void* poolAlloc(size_t size) {
+    int index = size < minPooled ? -1 : classOf(size);
+    if (index >= 0) {
+        if (!cacheClosed && cache.counts[index] > 0) {
+            void* buffer = cache.slots[index][--cache.counts[index]];
+            cache.bytes -= classBytes(index);
+            reused++;
+            return buffer;
+        }
+        SharedLists& lists = shared();
+        std::lock_guard<std::mutex> lock(lists.mutex);
+        std::vector<void*>& buffers = lists.buffers[index];
+        if (!buffers.empty()) {
+            void* buffer = buffers.back();
+            buffers.pop_back();
+            lists.held -= classBytes(index);
+            reused++;
+            return buffer;
+        }
+    }
+    Header* header = systemAlloc(index >= 0 ? classBytes(index) : (size > 0 ? size : 1));
+    if (header == nullptr) {
+        return nullptr;
+    }
+    header->sizeClass = index;
+    if (index >= 0) {
+        allocated++;
+    }
+    return reinterpret_cast<char*>(header) + headerSize;
+}
+
+void* poolRealloc(void* buffer, size_t size) {
+    if (buffer == nullptr) {
+        return poolAlloc(size);
+    }
+    Header* header = headerOf(buffer);
+    if (size <= header->capacity) {
+        return buffer;
+    }
+    void* grown = poolAlloc(size);
+    if (grown != nullptr) {
+        memcpy(grown, buffer, header->capacity);
+        poolFree(buffer);
+    }
+    return grown;
+}
+
+void poolFree(void* buffer) {
+    if (buffer == nullptr) {
+        return;
+    }
+    Header* header = headerOf(buffer);
+    int index = header->sizeClass;
+    if (index < 0) {
+        systemFree(header);
+        return;
+    }
+    if (!cacheClosed && cache.counts[index] < threadSlots && cache.bytes + header->capacity <= threadLimit) {
+        cache.slots[index][cache.counts[index]++] = buffer;
+        cache.bytes += header->capacity;
+        return;
+    }
+    releaseToShared(buffer);
+}
+
+PoolStats poolStats() {
+    SharedLists& lists = shared();
+    std::lock_guard<std::mutex> lock(lists.mutex);
+    return { reused.load(), allocated.load(), lists.held };
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+
+// Size class pool for pixel buffers, behind both Image::allocate and stb_image's allocator
+// Batch mode decodes thousands of images of the same few sizes, a fresh multi-MB malloc for each
+// is an mmap, page faults on first touch and a munmap when it's freed. Freed buffers are kept by
+// size class instead (a quarter of a power of two apart, so at most 25% is wasted) in a small
+// cache of the freeing thread first, then in shared lists, and handed out again: in steady state
+// decoding doesn't go to the system for memory. Buffers of 2 MB and more are mapped on their own
+// with transparent huge pages on Linux. Every buffer starts on a 64 byte boundary
+// The shared lists keep at most 512 MB, buffers freed past that go back to the system. Requests
+// under 64 KB go straight to malloc, they are stb's small scratch allocations
+
+
+void* poolAlloc(size_t size);
+void* poolRealloc(void* buffer, size_t size);
+void poolFree(void* buffer);  // Any thread, null is fine
+
+struct PoolStats {
+    long long reused;     // Pooled requests served from a cache or the shared lists
+    long long allocated;  // Pooled requests that went to the system
+    size_t held;          // Free bytes in the shared lists
+};
+PoolStats poolStats();
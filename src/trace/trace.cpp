@@ -0,0 +1,89 @@
+#include "trace.h"
+#ifdef BLUR_TRACE
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+
+
+struct TraceEvent {
+    const char* name;
+    long long begin;     // ns since traceEpoch
+    long long duration;  // ns
+};
+
+static const int traceBufferSize = 1 << 16;
+
+// Single writer (its thread), events are published with the release store on count
+struct TraceBuffer {
+    int tid;
+    std::atomic<int> count;
+    int dropped;
+    TraceEvent events[traceBufferSize];
+};
+
+static const auto traceEpoch = std::chrono::steady_clock::now();
+static std::mutex traceBuffersMutex;
+static std::vector<TraceBuffer*> traceBuffers;  // Never freed, so threads can exit before the dump
+
+static long long traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// Only runs once per thread
+static TraceBuffer* registerTraceBuffer() {
+    TraceBuffer* buffer = new TraceBuffer();
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->dropped = 0;
+    std::lock_guard<std::mutex> lock(traceBuffersMutex);
+    buffer->tid = static_cast<int>(traceBuffers.size());
+    traceBuffers.push_back(buffer);
+    return buffer;
+}
+
+static thread_local TraceBuffer* traceBuffer = registerTraceBuffer();
+
+TraceScope::TraceScope(const char* name) : name(name), begin(traceNow()) {
+
+}
+
+TraceScope::~TraceScope() {
+    TraceBuffer* buffer = traceBuffer;
+    int count = buffer->count.load(std::memory_order_relaxed);
+    if (count == traceBufferSize) {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events[count] = { name, begin, traceNow() - begin };
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+bool traceDump(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == nullptr) {
+        printf("Error opening trace file %s\n", filename);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(traceBuffersMutex);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const TraceBuffer* buffer : traceBuffers) {
+        int count = buffer->count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            const TraceEvent& event = buffer->events[i];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",\n", event.name, buffer->tid, event.begin / 1e3, event.duration / 1e3);
+            first = false;
+        }
+        if (buffer->dropped > 0) {
+            printf("Trace: thread %d dropped %d events\n", buffer->tid, buffer->dropped);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Trace: %s\n", filename);
+    return true;
+}
+
+#endif
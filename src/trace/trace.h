@@ -0,0 +1,27 @@
+#pragma once
+
+// Scoped CPU trace events, dumped as Chrome trace JSON (chrome://tracing or ui.perfetto.dev)
+// Compiled out unless BLUR_TRACE is defined, TRACE_SCOPE then expands to nothing
+// Every thread records into its own buffer, no locks on the hot path
+
+#ifdef BLUR_TRACE
+
+struct TraceScope {
+    const char* name;  // Must outlive the trace, string literals only
+    long long begin;
+    TraceScope(const char* name);
+    ~TraceScope();
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name)   TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+bool traceDump(const char* filename);
+
+#else
+
+#define TRACE_SCOPE(name)
+inline bool traceDump(const char*) { return false; }
+
+#endif